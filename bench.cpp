@@ -0,0 +1,396 @@
+// offline benchmarks of parsing and drawing, with the plugin built against a
+// mock of the EuroScope host rather than its DLL; run `make bench`, then
+// bin/bench.exe (under Wine elsewhere), optionally naming a renderer
+
+#include <cstdio>
+#include <random>
+
+// the EuroScope classes are defined below rather than imported
+#define DllSpecEuroScope
+
+#include "plot.cpp"
+
+
+
+// the state of the host: a synthetic sector file and a fixed view
+namespace mock {
+	struct Element {
+		int type;
+		std::string name;
+		std::vector<EuroScope::CPosition> positions;
+	};
+
+	std::vector<Element> sector;
+	StringMap<std::string> settings, asr;
+
+	RECT area = { 0, 0, 1600, 1000 };
+	// the position of the top left corner of the view, and its scale
+	double view_lat = 60.0, view_lon = -6.0, px_per_deg = 100.0;
+}
+
+EuroScope::CPlugIn::CPlugIn(int, const char *, const char *, const char *, const char *) :
+	m_pPluginData(nullptr) {}
+
+EuroScope::CPlugIn::~CPlugIn() {}
+
+void EuroScope::CPlugIn::SaveDataToSettings(const char *name, const char *, const char *value) {
+	mock::settings.insert_or_assign(name, value);
+}
+
+const char *EuroScope::CPlugIn::GetDataFromSettings(const char *name) {
+	auto it = mock::settings.find(name);
+	return it == mock::settings.end() ? nullptr : it->second.c_str();
+}
+
+void EuroScope::CPlugIn::DisplayUserMessage(
+	const char *, const char *from, const char *msg, bool, bool, bool, bool, bool
+) {
+	std::fprintf(stderr, "%s%s%s\n", from, *from ? ": " : "", msg);
+}
+
+// there is no traffic, so live plots always fail
+EuroScope::CFlightPlan EuroScope::CPlugIn::FlightPlanSelect(const char *) const {
+	return CFlightPlan();
+}
+
+EuroScope::CSectorElement EuroScope::CPlugIn::SectorFileElementSelectFirst(int type) const {
+	return SectorFileElementSelectNext(CSectorElement(), type);
+}
+
+EuroScope::CSectorElement EuroScope::CPlugIn::SectorFileElementSelectNext(CSectorElement el, int type) const {
+	for (size_t i = el.m_Position + 1; i < mock::sector.size(); i++)
+		if (type == SECTOR_ELEMENT_ALL || mock::sector[i].type == type) {
+			el.m_Position = i;
+			el.m_ElementType = mock::sector[i].type;
+
+			return el;
+		}
+
+	return CSectorElement();
+}
+
+const char *EuroScope::CSectorElement::GetName() const {
+	return mock::sector[m_Position].name.c_str();
+}
+
+bool EuroScope::CSectorElement::GetPosition(CPosition *pos, int j) {
+	const auto &positions = mock::sector[m_Position].positions;
+	if (j < 0 || (size_t) j >= positions.size()) return false;
+
+	*pos = positions[j];
+	return true;
+}
+
+const char *EuroScope::CSectorElement::GetRunwayName(int) const {
+	return "";
+}
+
+const char *EuroScope::CSectorElement::GetAirportName() const {
+	return "";
+}
+
+const char *EuroScope::CFlightPlan::GetCallsign() const {
+	return "";
+}
+
+EuroScope::CFlightPlanExtractedRoute EuroScope::CFlightPlan::GetExtractedRoute() const {
+	return CFlightPlanExtractedRoute();
+}
+
+int EuroScope::CFlightPlanExtractedRoute::GetPointsNumber() const {
+	return 0;
+}
+
+const char *EuroScope::CFlightPlanExtractedRoute::GetPointName(int) const {
+	return "";
+}
+
+EuroScope::CPosition EuroScope::CFlightPlanExtractedRoute::GetPointPosition(int) const {
+	return CPosition();
+}
+
+EuroScope::CRadarScreen::CRadarScreen() : m_pRadarView(nullptr), m_pPlugIn(nullptr) {}
+
+RECT EuroScope::CRadarScreen::GetRadarArea() {
+	return mock::area;
+}
+
+// equirectangular, which the plugin's fitted projection matches exactly
+EuroScope::CPosition EuroScope::CRadarScreen::ConvertCoordFromPixelToPosition(POINT point) {
+	CPosition pos;
+	pos.m_Latitude = mock::view_lat - point.y / mock::px_per_deg;
+	pos.m_Longitude = mock::view_lon + point.x / mock::px_per_deg;
+
+	return pos;
+}
+
+POINT EuroScope::CRadarScreen::ConvertCoordFromPositionToPixel(CPosition pos) {
+	return {
+		std::lround((pos.m_Longitude - mock::view_lon) * mock::px_per_deg),
+		std::lround((mock::view_lat - pos.m_Latitude) * mock::px_per_deg),
+	};
+}
+
+void EuroScope::CRadarScreen::SaveDataToAsr(const char *name, const char *, const char *value) {
+	mock::asr.insert_or_assign(name, value);
+}
+
+const char *EuroScope::CRadarScreen::GetDataFromAsr(const char *name) {
+	auto it = mock::asr.find(name);
+	return it == mock::asr.end() ? nullptr : it->second.c_str();
+}
+
+// the benchmarks refresh the screen themselves
+void EuroScope::CRadarScreen::RefreshMapContent() {}
+
+
+
+// the sector file is a square grid of fixes, with an airway along each row
+// and column, over the view
+const int GRID_SIZE = 200;
+const double GRID_SPACING = 0.05;
+
+static std::string fix_name(int row, int column) {
+	return std::format("F{:03}{:03}", row, column);
+}
+
+static EuroScope::CPosition fix_position(int row, int column) {
+	EuroScope::CPosition pos;
+	pos.m_Latitude = mock::view_lat - 0.2 - row * GRID_SPACING;
+	pos.m_Longitude = mock::view_lon + 0.2 + column * GRID_SPACING;
+
+	return pos;
+}
+
+static void make_sector() {
+	for (int row = 0; row < GRID_SIZE; row++)
+		for (int column = 0; column < GRID_SIZE; column++)
+			mock::sector.push_back({
+				EuroScope::SECTOR_ELEMENT_FIX, fix_name(row, column), { fix_position(row, column) }
+			});
+
+	// as in a real sector file, each segment of an airway is its own element
+	for (int j = 0; j < GRID_SIZE; j++)
+		for (int k = 1; k < GRID_SIZE; k++) {
+			mock::sector.push_back({
+				EuroScope::SECTOR_ELEMENT_LOW_AIRWAY, std::format("A{}", j),
+				{ fix_position(j, k - 1), fix_position(j, k) }
+			});
+			mock::sector.push_back({
+				EuroScope::SECTOR_ELEMENT_HIGH_AIRWAY, std::format("B{}", j),
+				{ fix_position(k - 1, j), fix_position(k, j) }
+			});
+		}
+}
+
+// a node in the legacy format, to the nearest second
+static void encode_node(std::string &out, double lat, double lon) {
+	static const char ALPHABET[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+
+	long lat_s = std::lround(std::abs(lat) * 3600.0), lon_s = std::lround(std::abs(lon) * 3600.0);
+	long lat_d = lat_s / 3600, lon_d = lon_s / 3600;
+
+	long flags = (lat < 0.0) << 1 | (lat_d >= 60) << 2 | (lon < 0.0) << 3 | (lon_d / 60) << 4;
+
+	for (long value : { flags, lat_d % 60, lat_s / 60 % 60, lat_s % 60, lon_d % 60, lon_s / 60 % 60, lon_s % 60 })
+		out += ALPHABET[value];
+}
+
+// a random walk over the view, optionally labelling every node
+static std::string make_coords(std::mt19937 &rng, size_t nodes, bool labels) {
+	std::uniform_real_distribution<double> step(-0.02, 0.02);
+	std::string out;
+
+	double lat = mock::view_lat - 5.0, lon = mock::view_lon + 8.0;
+
+	for (size_t i = 0; i < nodes; i++) {
+		lat = std::clamp(lat + step(rng), mock::view_lat - 9.9, mock::view_lat - 0.1);
+		lon = std::clamp(lon + step(rng), mock::view_lon + 0.1, mock::view_lon + 15.9);
+
+		encode_node(out, lat, lon);
+		if (labels) out += std::format("(P{})", i);
+	}
+
+	return out;
+}
+
+// along a row, then down a column, of the grid
+static std::string make_route(std::mt19937 &rng) {
+	std::uniform_int_distribution<int> index(0, GRID_SIZE - 1);
+	int row1 = index(rng), column1 = index(rng), row2 = index(rng), column2 = index(rng);
+
+	return std::format(
+		"{} A{} {} B{} {}",
+		fix_name(row1, column1), row1, fix_name(row1, column2), column2, fix_name(row2, column2)
+	);
+}
+
+static void report(const char *name, const Samples &samples) {
+	std::printf(
+		"%-36s p50 %8.3f ms  p99 %8.3f ms\n", name, samples.percentile(50.0), samples.percentile(99.0)
+	);
+}
+
+
+
+const int PARSE_ROUTES = 200;
+const size_t PARSE_NODES = 10000;
+
+static void bench_parse(std::mt19937 &rng) {
+	std::string name, error;
+
+	std::vector<std::string> coords;
+	for (int k = 0; k < PARSE_ROUTES; k++) coords.push_back(make_coords(rng, PARSE_NODES, false));
+
+	CoordsSource coords_source;
+	size_t bytes = 0, nodes = 0;
+	Clock::time_point start = Clock::now();
+
+	for (const auto &command : coords) {
+		Route route;
+		std::vector<std::string_view> args = tokenize(command);
+
+		if (!coords_source.Parse(args, command, route, name, error))
+			std::fprintf(stderr, "coords: %s\n", error.c_str());
+
+		bytes += command.size();
+		nodes += route.size();
+	}
+
+	double ms = elapsed_ms(start);
+	std::printf(
+		"%-36s %8.2f ns/node  %8.1f MB/s\n", "parse coords",
+		ms * 1e6 / nodes, bytes / 1e3 / ms
+	);
+
+	std::vector<std::string> routes;
+	for (int k = 0; k < PARSE_ROUTES * 10; k++) routes.push_back(make_route(rng));
+
+	RouteSource route_source;
+	nodes = 0;
+	start = Clock::now();
+
+	for (const auto &command : routes) {
+		Route route;
+		std::vector<std::string_view> args = tokenize(command);
+
+		if (!route_source.Parse(args, command, route, name, error))
+			std::fprintf(stderr, "route: %s\n", error.c_str());
+
+		nodes += route.size();
+	}
+
+	ms = elapsed_ms(start);
+	std::printf(
+		"%-36s %8.2f ns/node  %8.1f us/route\n", "parse and resolve route",
+		ms * 1e6 / nodes, ms * 1e3 / routes.size()
+	);
+}
+
+const int REFRESHES = 50;
+const size_t REFRESH_NODES[] = { 1000, 10000, 100000, 1000000 };
+const size_t LABELLED_NODES = 10000;
+
+// refreshes with the view panned by a pixel each time, so that each is
+// projected and drawn again, and with it still, so that layers are reused
+static void bench_refresh(Screen *screen, HDC hdc, const std::string &coords, const std::string &title) {
+	plugin->OnCompileCommand(".plot clear");
+	plugin->OnCompileCommand((".plot coords BENCH " + coords).c_str());
+
+	Samples panned, still;
+
+	for (int k = 0; k < REFRESHES; k++) {
+		mock::view_lon += (k % 2 ? -1.0 : 1.0) / mock::px_per_deg;
+
+		Clock::time_point start = Clock::now();
+		screen->OnRefresh(hdc, EuroScope::REFRESH_PHASE_BACK_BITMAP);
+		panned.add(elapsed_ms(start));
+	}
+
+	for (int k = 0; k < REFRESHES; k++) {
+		Clock::time_point start = Clock::now();
+		screen->OnRefresh(hdc, EuroScope::REFRESH_PHASE_BACK_BITMAP);
+		still.add(elapsed_ms(start));
+	}
+
+	report(("refresh " + title + ", panned").c_str(), panned);
+	report(("refresh " + title + ", still").c_str(), still);
+}
+
+const int LABELS_PLACED = 100000;
+
+static void bench_labels(std::mt19937 &rng) {
+	std::uniform_real_distribution<float> x(0.0f, mock::area.right), y(0.0f, mock::area.bottom);
+
+	LabelGrid grid(mock::area);
+	int placed = 0;
+	Clock::time_point start = Clock::now();
+
+	for (int k = 0; k < LABELS_PLACED; k++)
+		placed += grid.place(Gdiplus::RectF(x(rng), y(rng), 60.0f, 14.0f));
+
+	double ms = elapsed_ms(start);
+	std::printf(
+		"%-36s %8.2f ns/label  %d of %d placed\n", "label grid",
+		ms * 1e6 / LABELS_PLACED, placed, LABELS_PLACED
+	);
+}
+
+int main(int argc, char **argv) {
+	Gdiplus::GdiplusStartupInput gdiplus_input;
+	ULONG_PTR gdiplus_token;
+	Gdiplus::GdiplusStartup(&gdiplus_token, &gdiplus_input, nullptr);
+
+	// the same seed every run, so that runs are comparable
+	std::mt19937 rng(1);
+
+	make_sector();
+	plugin = new Plugin;
+
+	if (argc > 1) plugin->OnCompileCommand(std::format(".plot renderer {}", argv[1]).c_str());
+
+	while (!plugin->navdata()) {
+		plugin->OnTimer(0);
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	Screen *screen = plugin->OnRadarScreenCreated("", false, false, true, false);
+
+	// a top-down 32-bit bitmap, as EuroScope draws into
+	BITMAPINFO info = {};
+	info.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+	info.bmiHeader.biWidth = mock::area.right;
+	info.bmiHeader.biHeight = -mock::area.bottom;
+	info.bmiHeader.biPlanes = 1;
+	info.bmiHeader.biBitCount = 32;
+	info.bmiHeader.biCompression = BI_RGB;
+
+	void *bits;
+	HDC hdc = CreateCompatibleDC(nullptr);
+	HBITMAP bitmap = CreateDIBSection(hdc, &info, DIB_RGB_COLORS, &bits, nullptr, 0);
+	HGDIOBJ old_bitmap = SelectObject(hdc, bitmap);
+
+	bench_parse(rng);
+
+	for (size_t nodes : REFRESH_NODES)
+		bench_refresh(screen, hdc, make_coords(rng, nodes, false), std::format("{} nodes", nodes));
+
+	bench_refresh(
+		screen, hdc, make_coords(rng, LABELLED_NODES, true), std::format("{} labelled", LABELLED_NODES)
+	);
+	bench_labels(rng);
+
+	// the plugin's own breakdown of the refreshes
+	plugin->OnCompileCommand(".plot stats");
+
+	screen->OnAsrContentToBeClosed();
+	delete plugin;
+
+	SelectObject(hdc, old_bitmap);
+	DeleteObject(bitmap);
+	DeleteDC(hdc);
+
+	Gdiplus::GdiplusShutdown(gdiplus_token);
+
+	return 0;
+}
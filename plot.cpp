@@ -1,25 +1,45 @@
 #include <cctype>
 #include <cmath>
 #include <cstddef>
+#include <cstdint>
 #include <cstring>
 
 #include <algorithm>
+#include <array>
+#include <charconv>
+#include <chrono>
+#include <deque>
 #include <format>
+#include <fstream>
+#include <future>
 #include <memory>
+#include <mutex>
 #include <iterator>
+#include <list>
+#include <map>
 #include <numbers>
 #include <optional>
-#include <sstream>
+#include <set>
+#include <span>
 #include <string>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
 #include <windows.h>
 #undef max //
 
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
 #include <gdiplus.h>
 #include <gdiplusgraphics.h>
+#include <d2d1.h>
+#include <dwrite.h>
+#undef min //
 
 #include <EuroScopePlugIn.hpp>
 
@@ -36,17 +56,44 @@
 
 namespace EuroScope = EuroScopePlugIn;
 
+// identical labels, of any route, share a single immutable string
+class Interner {
+private:
+	std::deque<std::wstring> strings;
+	std::unordered_map<std::wstring_view, uint32_t> ids;
+	std::wstring scratch;
+	// routes may be parsed in parallel, while nothing is drawn
+	std::mutex mutex;
+
+	uint32_t intern_locked(std::wstring_view);
+
+public:
+	uint32_t intern(std::wstring_view);
+	// widens each character, as for the ASCII used in commands
+	uint32_t intern(std::string_view);
+
+	const std::wstring &operator[](uint32_t id) const {
+		return strings[id];
+	}
+
+	size_t size() const {
+		return strings.size();
+	}
+};
+
 struct Hold {
 	double length, course;
 	bool left_turns;
+	// start of the inbound leg
+	double start_lat, start_lon;
 
-	Hold(double len, double crs, bool lh) : length(len), course(crs), left_turns(lh) {}
+	Hold(double lat, double lon, double len, double crs, bool lh);
 };
 
 struct Node {
 	double lat, lon;
 	bool highlight = false;
-	std::wstring label;
+	std::optional<uint32_t> label;
 	std::optional<Hold> hold;
 
 	Node() = default;
@@ -61,7 +108,301 @@ struct Node {
 	}
 };
 
-using Route = std::vector<Node>;
+// a route, stored as arrays of coordinates with sparse per-node attributes
+class Route {
+public:
+	std::vector<float> lat, lon;
+	// nodes not joined to the node before, ascending; while building, the
+	// last may be size() to mark a trailing discontinuity
+	std::vector<uint32_t> breaks;
+	// attributes, ascending by node
+	std::vector<uint32_t> highlights;
+	std::vector<std::pair<uint32_t, uint32_t>> labels;
+	std::vector<std::pair<uint32_t, Hold>> holds;
+
+	size_t size() const {
+		return lat.size();
+	}
+
+	bool empty() const {
+		return lat.empty();
+	}
+
+	void reserve(size_t n) {
+		lat.reserve(n);
+		lon.reserve(n);
+	}
+
+	// appends a node, or a break if it is a discontinuity
+	void push_back(const Node &);
+	// labels the last node, unless there is none or a break has been added since
+	void label_last(uint32_t);
+
+	bool joined(size_t) const;
+	bool highlighted(size_t) const;
+	std::optional<uint32_t> label(size_t) const;
+};
+
+struct Bounds {
+	double min_lat = INFINITY, min_lon = INFINITY;
+	double max_lat = -INFINITY, max_lon = -INFINITY;
+
+	void extend(double lat, double lon, double pad = 0.0);
+	void extend(const Bounds &);
+	bool intersects(const Bounds &) const;
+	bool contains(double lat, double lon) const;
+	bool contains(const Bounds &) const;
+};
+
+// a route, with the geographic data derived from it for drawing; built once
+// when the plot is stored, then shared by every screen and never modified
+struct Plot {
+	Route route;
+	// interned name, for drawing
+	uint32_t name;
+	// Mercator ordinates of the nodes, for fitted projections
+	std::vector<float> mercator;
+	// cumulative along-track distances of the nodes in nmi, not counting
+	// breaks, for placing name labels
+	std::vector<double> along;
+	Bounds bounds;
+	// consecutive nodes are grouped into the leaves of a flat R-tree, so runs
+	// of off-screen segments can be skipped together; leaf k covers nodes
+	// k * SEGMENTS_PER_LEAF through (k + 1) * SEGMENTS_PER_LEAF inclusive
+	std::vector<Bounds> leaves;
+	// the area of each hold's racetrack, in the order of route.holds
+	std::vector<Bounds> hold_bounds;
+
+	// simplified versions of the route, each keeping the nodes which deviate
+	// from it by over its tolerance and those with attributes, by coarseness
+	struct Level {
+		double tolerance; // in nmi
+		std::vector<uint32_t> nodes;
+		// as above, but indexing into nodes
+		std::vector<Bounds> leaves;
+	};
+
+	std::vector<Level> levels;
+
+	// the coarsest level within the tolerance, or null for the full route
+	const Level *level(double tolerance) const;
+	// approximate bytes held, including the route
+	size_t memory(void) const;
+
+	Plot(const std::string &, Route &&);
+};
+
+// screens keep the plots they have projected, so a plot is replaced rather
+// than changed, and screens can tell by its identity
+using PlotRef = std::shared_ptr<const Plot>;
+
+// plots by name, kept in the order they were first added, which is the order
+// they are drawn in
+class PlotMap {
+private:
+	using List = std::list<std::pair<const std::string, PlotRef>>;
+
+	List plots;
+	// views of the names held by the nodes of plots
+	std::unordered_map<std::string_view, List::iterator> index;
+
+public:
+	using iterator = List::iterator;
+	using const_iterator = List::const_iterator;
+
+	iterator begin() { return plots.begin(); }
+	iterator end() { return plots.end(); }
+	const_iterator begin() const { return plots.cbegin(); }
+	const_iterator end() const { return plots.cend(); }
+
+	bool empty() const {
+		return plots.empty();
+	}
+
+	size_t size() const {
+		return plots.size();
+	}
+
+	iterator find(std::string_view name) {
+		auto it = index.find(name);
+		return it != index.end() ? it->second : plots.end();
+	}
+
+	const_iterator find(std::string_view name) const {
+		auto it = index.find(name);
+		return it != index.end() ? it->second : plots.cend();
+	}
+
+	// a replaced plot keeps its place in the order
+	void insert_or_assign(const std::string &, PlotRef);
+	iterator erase(iterator);
+	void clear();
+};
+
+// an affine fit of the screen projection, from longitude and either latitude
+// or the Mercator ordinate to pixels; it is only checked within the bounds it
+// was sampled over, so isn't used beyond them
+struct Transform {
+	double ax, bx, cx, ay, by, cy;
+	bool mercator;
+
+	POINT apply(double u, double v) const {
+		return { std::lround(ax * u + bx * v + cx), std::lround(ay * u + by * v + cy) };
+	}
+};
+
+// placed labels, bucketed into a uniform grid over the view for collision tests
+class LabelGrid {
+private:
+	RECT area;
+	int columns, rows;
+	std::vector<std::vector<Gdiplus::RectF>> cells;
+
+public:
+	LabelGrid(const RECT &);
+
+	// places the label if it does not overlap any already placed
+	bool place(const Gdiplus::RectF &);
+};
+
+using Clock = std::chrono::steady_clock;
+
+// the latest timings of something, in ms, for reporting percentiles
+class Samples {
+private:
+	std::vector<float> window;
+	size_t next = 0, total = 0;
+
+public:
+	void add(double);
+
+	// all timings added, including those since dropped from the window
+	size_t count() const {
+		return total;
+	}
+
+	// of the timings in the window, or 0 if there are none
+	double percentile(double) const;
+};
+
+// the drawing operations used for routes, so that the layout is shared by the
+// GDI+ and Direct2D backends
+class Renderer {
+public:
+	enum TextStyle { TEXT_NAME, TEXT_LABEL };
+
+	virtual ~Renderer() = default;
+
+	virtual void DrawLine(POINT, POINT, Gdiplus::Color) = 0;
+	virtual void DrawGradientLine(POINT, POINT, Gdiplus::Color, Gdiplus::Color) = 0;
+	// as Gdiplus::Graphics::DrawArc, with angles in degrees clockwise
+	virtual void DrawArc(POINT corner, long size, double start, double sweep, Gdiplus::Color) = 0;
+	virtual void DrawEllipse(POINT centre, int radius, Gdiplus::Color) = 0;
+
+	// the segments in each band of the colour ramp are stroked together, so
+	// that contiguous segments are joined
+	virtual void AddBandLine(int band, POINT, POINT, bool start_figure) = 0;
+	virtual void DrawBands(void) = 0;
+
+	// strings are interned, and rotated clockwise in degrees about their origin
+	virtual void DrawString(uint32_t, Gdiplus::PointF origin, double angle, TextStyle) = 0;
+	virtual const Gdiplus::RectF &MeasureString(uint32_t) = 0;
+};
+
+struct ComRelease {
+	void operator()(IUnknown *object) const {
+		object->Release();
+	}
+};
+
+template<typename T>
+using ComPtr = std::unique_ptr<T, ComRelease>;
+
+struct Position {
+	double lat, lon;
+
+	inline bool operator==(const Position &) const = default;
+};
+
+struct StringHash {
+	using is_transparent = void;
+
+	size_t operator()(std::string_view sv) const {
+		return std::hash<std::string_view>{}(sv);
+	}
+};
+
+template <typename T>
+using StringMap = std::unordered_map<std::string, T, StringHash, std::equal_to<>>;
+
+// copy of the sector file data used by Navdata, taken on the main thread
+struct SectorElement {
+	int type;
+	std::string name, airport, runways[2];
+	std::vector<Position> positions;
+};
+
+struct PositionHash {
+	size_t operator()(const Position &pos) const {
+		return std::hash<double>{}(pos.lat) ^ (std::hash<double>{}(pos.lon) * 31);
+	}
+};
+
+// an airway or procedure; the sector file only gives the positions along it,
+// so its fixes are found by position
+struct Path {
+	std::vector<Position> positions;
+	// the first index of each position
+	std::unordered_map<Position, size_t, PositionHash> indices;
+
+	void build_index(void);
+	std::optional<size_t> find(const Position &) const;
+};
+
+class Navdata {
+public:
+	// fixes, VORs, NDBs and airports
+	StringMap<Position> points;
+	StringMap<Position> airports;
+	// keyed by "<AIRPORT>/<RUNWAY>"
+	StringMap<Position> runways;
+	StringMap<Path> airways;
+	// keyed by "<AIRPORT>/<RUNWAY>/<NAME>", and "<AIRPORT>//<NAME>" for any runway
+	StringMap<Path> procedures;
+	// a hash of the sector file data it was built from
+	uint64_t version;
+
+	Navdata(const std::vector<SectorElement> &);
+
+	const Position *find_point(std::string_view) const;
+	const Position *find_airport(std::string_view airport, std::string_view runway) const;
+	const Path *find_airway(std::string_view) const;
+	const Path *find_procedure(
+		std::string_view airport, std::string_view runway, std::string_view name
+	) const;
+};
+
+// a memory-mapped file of routes in the binary format, decoded only when plotted
+class Library {
+private:
+	HANDLE file = INVALID_HANDLE_VALUE, mapping = nullptr;
+	const uint8_t *view = nullptr;
+	// views into the mapping
+	StringMap<std::span<const uint8_t>> entries;
+
+public:
+	Library() = default;
+	Library(const Library &) = delete;
+	Library &operator=(const Library &) = delete;
+	~Library();
+
+	bool open(const std::string &path, std::string &error);
+	bool load(std::string_view name, Route &route, std::string &error) const;
+
+	size_t size() const {
+		return entries.size();
+	}
+};
 
 class Source {
 public:
@@ -73,10 +414,20 @@ public:
 		return "null source";
 	}
 
+	virtual bool RequiresNavdata() const {
+		return false;
+	}
+
+	// follows the flight plan named by the last argument, so is parsed on the
+	// main thread, and again whenever the flight plan changes
+	virtual bool Live() const {
+		return false;
+	}
+
+	// args are views into args_src, which runs from the first of them to the end of the command
 	virtual bool Parse(
-		std::vector<std::string>::iterator args_it,
-		std::vector<std::string>::iterator args_end,
-		const char *args_src,
+		std::span<const std::string_view> args,
+		std::string_view args_src,
 		Route &route,
 		std::string &name,
 		std::string &error
@@ -86,33 +437,292 @@ public:
 	}
 };
 
+// a plot command split into its source and arguments, as views into the command
+struct PlotCommand {
+	std::string_view text;
+	const Source *source = nullptr;
+	std::vector<std::string_view> args;
+	std::string_view src;
+};
+
 class Screen : public EuroScope::CRadarScreen {
+	friend class Plugin;
+
 private:
+	struct ProjectedHold {
+		size_t node;
+		POINT oc, ic, os, oe, is, ie;
+		long d, r;
+		double angle;
+	};
+
+	// a name label, in pixels and radians
+	struct ProjectedLabel {
+		double x, y, angle;
+	};
+
+	struct ProjectedSegment {
+		uint32_t from, to;
+		POINT point1, point2;
+	};
+
+	struct ProjectedNode {
+		uint32_t node;
+		POINT point;
+	};
+
+	// only what is within the view is projected, so each screen holds no more
+	// than it draws, along with the plot shared with the others
+	struct ProjectedRoute {
+		std::vector<ProjectedSegment> segments;
+		std::vector<ProjectedNode> nodes;
+		std::vector<ProjectedHold> holds;
+		std::vector<ProjectedLabel> labels;
+		// the plot it was projected from, or null to be projected again
+		PlotRef plot;
+		std::string group;
+
+		bool empty() const {
+			return segments.empty() && nodes.empty() && holds.empty() && labels.empty();
+		}
+
+		size_t memory(void) const;
+	};
+
 	size_t i;
 
+	// each group of routes, drawn with the current projection
+	struct Layer {
+		std::unique_ptr<Gdiplus::Bitmap> bitmap;
+		bool valid = false;
+		unsigned used = 0;
+	};
+
+	// by group, in drawing order
+	std::map<std::string, Layer, std::less<>> layers;
+	bool layer_smooth = false;
+
+	// the names of plots and groups not drawn on this screen
+	std::unordered_set<std::string> hidden;
+
+	// GDI+ objects for drawing, kept until the device context changes
+	struct Resources {
+		HDC hdc;
+		int width, height, screen_width, screen_height;
+
+		std::unique_ptr<Gdiplus::Graphics> ctx;
+		Gdiplus::FontFamily font_family;
+		Gdiplus::Font font;
+		Gdiplus::Pen pen, brush_pen;
+		Gdiplus::SolidBrush name_brush, label_brush;
+		// one pen per band of the colour ramp
+		std::vector<std::unique_ptr<Gdiplus::Pen>> ramp_pens;
+
+		Resources(HDC, const RECT &);
+
+		bool matches(HDC, const RECT &) const;
+		const Gdiplus::RectF &measure(Gdiplus::Graphics *, uint32_t);
+	};
+
+	std::unique_ptr<Resources> resources;
+
+	// Direct2D objects for drawing straight to the device context, kept until
+	// the render target is lost
+	struct Direct2D {
+		ComPtr<ID2D1Factory> factory;
+		ComPtr<ID2D1DCRenderTarget> target;
+		ComPtr<ID2D1SolidColorBrush> brush, name_brush, label_brush;
+		std::vector<ComPtr<ID2D1SolidColorBrush>> ramp_brushes;
+
+		ComPtr<IDWriteFactory> write_factory;
+		ComPtr<IDWriteTextFormat> format;
+		// laid out labels and their extents, by interned string
+		std::vector<ComPtr<IDWriteTextLayout>> layouts;
+		std::vector<std::optional<Gdiplus::RectF>> extents;
+
+		// null if Direct2D is unavailable
+		static std::unique_ptr<Direct2D> create(void);
+
+		IDWriteTextLayout *layout(uint32_t);
+	};
+
+	std::unique_ptr<Direct2D> direct2d;
+	bool direct2d_failed = false;
+
+	class GdiplusRenderer;
+	class Direct2DRenderer;
+
+	// pixel-space geometry, valid for a given route set and view
+	std::unordered_map<std::string, ProjectedRoute> projected;
+	std::optional<Transform> transform;
+	unsigned projected_version = 0;
+	RECT projected_area = {};
+	EuroScope::CPosition projected_view[2];
+	Bounds projected_bounds;
+	double projected_scale = 1.0; // px per nmi
+
+	// the phases of a refresh in ms, which are 0 where layers were reused
+	struct RefreshTimes {
+		double projection, lines, holds, labels;
+	};
+
+	RefreshTimes refresh_times;
+	Samples refresh_samples, projection_samples, lines_samples, holds_samples, labels_samples;
+
 public:
 	Screen(size_t _i) : i(_i) {}
 
+	void OnAsrContentLoaded(bool) override;
+	void OnAsrContentToBeSaved(void) override;
 	void OnAsrContentToBeClosed(void) override;
 	void OnRefresh(HDC, int) override;
+	bool OnCompileCommand(const char *) override;
+
+	// compares the fitted projection against EuroScope, for every node
+	std::string validate_projection(void);
+	// whether anything within the bounds was in view when last drawn
+	bool shows(const Bounds &) const;
+
+private:
+	void draw(HDC);
+	void record_refresh(double);
+
+	bool reserve_layer(size_t);
+	void release_layer(Layer &);
+	void release_layers(void);
+	void invalidate_layer(std::string_view group);
+	// the groups with anything projected, in drawing order
+	std::set<std::string_view> visible_groups(void) const;
+	void draw_direct2d(HDC, const RECT &);
+	void draw_routes(Renderer &, const RECT &, std::string_view group);
+
+	Bounds view_bounds(const RECT &);
+	std::optional<Transform> fit_projection(const Bounds &);
+	POINT project(double lat, double lon);
+	void update_projection(const RECT &);
+	void project_route(const std::string &name, const PlotRef &, ProjectedRoute &);
+	void project_labels(const Plot &, ProjectedRoute &);
+	static ProjectedHold project_hold(size_t, const Hold &, POINT, POINT);
 };
 
 class Plugin : public EuroScope::CPlugIn {
 	friend class Screen;
 
 private:
-	std::unordered_map<std::string, Route> routes;
-	std::unordered_map<std::string, std::unique_ptr<Source>> sources;
+	PlotMap routes;
+	StringMap<std::unique_ptr<Source>> sources;
 	std::vector<Screen *> screens;
 	int name_counter = 0;
+	// incremented whenever routes is modified
+	unsigned routes_version = 1;
+	// draw each segment with its own gradient, rather than banding the ramp
+	bool smooth_gradients = false;
+	// draw with Direct2D where it is available, rather than GDI+
+	bool direct2d = false;
+	// total size of the screens' layers, and the clock for evicting them
+	size_t layer_bytes = 0;
+	unsigned layer_clock = 0;
+	// GDI+ label extents relative to their origin, by interned string; every
+	// screen draws with the same font, so they are measured once for all
+	std::vector<std::optional<Gdiplus::RectF>> label_extents;
+
+	// the current index is kept in use until its replacement is ready
+	std::shared_ptr<const Navdata> navdata_cache;
+	std::vector<SectorElement> navdata_snapshot;
+	EuroScope::CSectorElement navdata_cursor;
+	bool navdata_loading = false, navdata_stale = false;
+	std::future<std::shared_ptr<const Navdata>> navdata_future;
+	std::vector<std::string> pending_commands;
+	std::unique_ptr<Library> library;
+
+	struct LivePlot {
+		std::string callsign, command;
+	};
+
+	// plots following flight plans, by plot name
+	std::unordered_map<std::string, LivePlot> live_plots;
+	// plots not in the default group, by plot name
+	std::unordered_map<std::string, std::string> plot_groups;
+
+	struct ResolvedPlot {
+		std::string command;
+		// of the navigation data it was resolved against
+		uint64_t navdata;
+	};
+
+	// plots resolved against the navigation data, by plot name, so that they
+	// can be saved already resolved and resolved again if it changes
+	std::unordered_map<std::string, ResolvedPlot> resolved_plots;
+	// restored plots not yet checked against the navigation data
+	std::unordered_set<std::string> restored_plots;
+
+	// screens to be redrawn, by index
+	std::vector<bool> dirty_screens;
+	bool refreshed_this_tick = false;
+
+	// parse timings by source name, and those of deriving plots from routes
+	StringMap<Samples> parse_samples;
+	Samples build_samples;
+	// completed sector file snapshots, with the size and main thread time
+	// of the last, and the time so far of any in progress
+	unsigned navdata_scans = 0;
+	size_t navdata_elements = 0;
+	double navdata_scan_ms = 0.0, navdata_scanning_ms = 0.0;
+	// each timing is also written here while tracing, as CSV
+	std::ofstream trace;
+	Clock::time_point trace_start;
 
 public:
 	Plugin(void);
 
 	bool OnCompileCommand(const char *) override;
 	Screen *OnRadarScreenCreated(const char *, bool, bool, bool, bool) override;
+	void OnAirportRunwayActivityChanged(void) override;
+	void OnTimer(int) override;
+	void OnFlightPlanFlightPlanDataUpdate(EuroScope::CFlightPlan) override;
+	void OnFlightPlanDisconnect(EuroScope::CFlightPlan) override;
+
+	const Navdata *navdata(void) const;
+	const std::string &group_of(const std::string &name) const;
 
 private:
+	// parses one plot command (without the prefix) and adds it, without refreshing
+	bool add_plot(const PlotCommand &, std::string &);
+	// safe to call from several threads at once, while the navigation data is unchanged
+	PlotCommand split_plot(std::string_view) const;
+	// as above, given the command already tokenized
+	PlotCommand split_plot(std::string_view, std::span<const std::string_view>) const;
+	bool parse_plot(const PlotCommand &, std::string &, Route &, std::string &) const;
+	// replaces any plot of the same name, which stops following its flight
+	// plan and forgets how it was resolved
+	void store_plot(const std::string &, Plot &&);
+	// marks the screens showing the bounds, one screen, or all screens, to
+	// be redrawn
+	void invalidate(const Bounds &);
+	void invalidate(const Screen &);
+	void invalidate(void);
+	// redraws the marked screens, at most once per timer tick
+	void flush(void);
+
+	// saved with each screen's ASR, and restored with it
+	void save_plots(Screen &);
+	void restore_plots(Screen &);
+	bool restore_plot(std::string_view);
+	// resolves restored plots again if the navigation data has changed
+	void resolve_restored(void);
+
+	void record_parse(const Source *, double);
+	void record_build(double);
+	void record_trace(const char *event, std::string_view subject, const char *phase, double ms);
+	void display_stats(void);
+
+	void reload_navdata(void);
+	void update_navdata(void);
+	// copies the next chunk of the sector file, if it is being read
+	void scan_navdata(void);
+	// how far the navigation data has loaded, for messages
+	std::string navdata_progress(void) const;
+
 	void display_message(const char *from, const char *msg, bool urgent = false);
 	void display_command(const char *command, const char *help, size_t width);
 };
@@ -128,8 +738,7 @@ public:
 	}
 
 	bool Parse(
-		std::vector<std::string>::iterator, std::vector<std::string>::iterator,
-		const char *, Route &, std::string &, std::string &
+		std::span<const std::string_view>, std::string_view, Route &, std::string &, std::string &
 	) const override;
 };
 
@@ -143,15 +752,53 @@ public:
 		return "Plot a flight plan route";
 	}
 
+	bool RequiresNavdata() const override {
+		return true;
+	}
+
+	bool Parse(
+		std::span<const std::string_view>, std::string_view, Route &, std::string &, std::string &
+	) const override;
+};
+
+class FlightPlanSource : public virtual Source {
+public:
+	const char *HelpArguments() const override {
+		return "<CALLSIGN>";
+	}
+
+	const char *HelpDescription() const override {
+		return "Plot an aircraft's route, following its flight plan";
+	}
+
+	bool Live() const override {
+		return true;
+	}
+
 	bool Parse(
-		std::vector<std::string>::iterator, std::vector<std::string>::iterator,
-		const char *, Route &, std::string &, std::string &
+		std::span<const std::string_view>, std::string_view, Route &, std::string &, std::string &
+	) const override;
+};
+
+class BinarySource : public virtual Source {
+public:
+	const char *HelpArguments() const override {
+		return "<BASE64>";
+	}
+
+	const char *HelpDescription() const override {
+		return "Plot a route in the binary format, for external tools";
+	}
+
+	bool Parse(
+		std::span<const std::string_view>, std::string_view, Route &, std::string &, std::string &
 	) const override;
 };
 
 
 
 Plugin *plugin;
+Interner strings;
 
 void __declspec(dllexport) EuroScopePlugInInit(EuroScope::CPlugIn **ptr) {
 	*ptr = plugin = new Plugin;
@@ -164,419 +811,3247 @@ void __declspec(dllexport) EuroScopePlugInExit(void) {
 
 
 
-void Screen::OnAsrContentToBeClosed() {
-	if (plugin) plugin->screens[i] = nullptr;
-	delete this;
+void Bounds::extend(double lat, double lon, double pad) {
+	double lon_pad = pad / std::max(std::cos(lat / (180.0 / std::numbers::pi)), 0.01);
+
+	min_lat = std::min(min_lat, lat - pad);
+	max_lat = std::max(max_lat, lat + pad);
+	min_lon = std::min(min_lon, lon - lon_pad);
+	max_lon = std::max(max_lon, lon + lon_pad);
 }
 
-const double HOLD_RADIUS = 2.0;
-const double STROKE_WIDTH = 1.0;
-const double LABEL_INTERVAL = 0.25;
-const int FONT_SIZE = 12;
+void Bounds::extend(const Bounds &other) {
+	min_lat = std::min(min_lat, other.min_lat);
+	max_lat = std::max(max_lat, other.max_lat);
+	min_lon = std::min(min_lon, other.min_lon);
+	max_lon = std::max(max_lon, other.max_lon);
+}
+
+bool Bounds::intersects(const Bounds &other) const {
+	return min_lat <= other.max_lat && other.min_lat <= max_lat
+		&& min_lon <= other.max_lon && other.min_lon <= max_lon;
+}
+
+bool Bounds::contains(double lat, double lon) const {
+	return min_lat <= lat && lat <= max_lat && min_lon <= lon && lon <= max_lon;
+}
+
+bool Bounds::contains(const Bounds &other) const {
+	return min_lat <= other.min_lat && other.max_lat <= max_lat
+		&& min_lon <= other.min_lon && other.max_lon <= max_lon;
+}
 
 const double DEG_LAT_PER_NM = 60.007;
 const double DEG_PER_RAD = 180.0 / std::numbers::pi;
 
-static Gdiplus::Color colour(double t) {
-	int x = 255.0 * (1.0 - std::abs(1.0 - t * 2.0));
-	return Gdiplus::Color(t < 0.5 ? 255 : x, 0, t > 0.5 ? 255 : x);
+Hold::Hold(double lat, double lon, double len, double crs, bool lh) :
+	length(len), course(crs), left_turns(lh)
+{
+	// approximation
+	double crs_rad = course / DEG_PER_RAD;
+	double lat_rad = lat / DEG_PER_RAD;
+	double len_deg = length / DEG_LAT_PER_NM;
+	start_lat = lat - len_deg * std::cos(crs_rad);
+	start_lon = lon - len_deg * std::sin(crs_rad) / std::cos(lat_rad);
 }
 
-void Screen::OnRefresh(HDC hdc, int phase) {
-	using namespace Gdiplus;
+uint32_t Interner::intern(std::wstring_view str) {
+	std::lock_guard lock(mutex);
+	return intern_locked(str);
+}
+
+uint32_t Interner::intern_locked(std::wstring_view str) {
+	auto it = ids.find(str);
+	if (it != ids.end()) return it->second;
+
+	uint32_t id = strings.size();
+	ids.emplace(strings.emplace_back(str), id);
+
+	return id;
+}
+
+uint32_t Interner::intern(std::string_view str) {
+	std::lock_guard lock(mutex);
+
+	scratch.clear();
+	for (char c : str) scratch.push_back((std::wstring::value_type) c);
+
+	return intern_locked(std::wstring_view(scratch));
+}
+
+// splits on spaces and tabs, up to the limit of tokens; each token is a view
+// into the command
+static std::vector<std::string_view> tokenize(std::string_view str, size_t limit = SIZE_MAX) {
+	std::vector<std::string_view> tokens;
+
+	for (size_t end = 0; tokens.size() < limit;) {
+		size_t start = str.find_first_not_of(" \t", end);
+		if (start == std::string_view::npos) break;
+
+		end = std::min(str.find_first_of(" \t", start), str.size());
+		tokens.push_back(str.substr(start, end - start));
+	}
+
+	return tokens;
+}
+
+// ASR values may not contain ':', CR or LF, so those are percent-encoded,
+// along with '%' itself
+static std::string escape_asr(std::string_view str) {
+	std::string out;
+	out.reserve(str.size());
+
+	for (char c : str) {
+		if (c == '%' || c == ':' || c == '\r' || c == '\n') out += std::format("%{:02X}", (unsigned char) c);
+		else out += c;
+	}
+
+	return out;
+}
+
+static std::string unescape_asr(std::string_view str) {
+	std::string out;
+	out.reserve(str.size());
+
+	for (size_t i = 0; i < str.size(); i++) {
+		unsigned value;
+		if (
+			str[i] == '%' && i + 2 < str.size() &&
+			std::from_chars(str.data() + i + 1, str.data() + i + 3, value, 16).ptr == str.data() + i + 3
+		) {
+			out += (char) value;
+			i += 2;
+		} else {
+			out += str[i];
+		}
+	}
+
+	return out;
+}
+
+static std::string to_upper(std::string_view str) {
+	std::string upper(str);
+	for (char &c : upper) c = (char) std::toupper((unsigned char) c);
+
+	return upper;
+}
+
+void Route::push_back(const Node &node) {
+	if (node.IsDiscontinuity()) {
+		if (!empty() && (breaks.empty() || breaks.back() != size())) breaks.push_back(size());
+		return;
+	}
+
+	uint32_t i = size();
+
+	lat.push_back(node.lat);
+	lon.push_back(node.lon);
+
+	if (node.highlight) highlights.push_back(i);
+	if (node.label) labels.emplace_back(i, *node.label);
+	if (node.hold) holds.emplace_back(i, *node.hold);
+}
+
+void Route::label_last(uint32_t label) {
+	if (empty() || (!breaks.empty() && breaks.back() == size())) return;
+
+	uint32_t i = size() - 1;
+	if (!labels.empty() && labels.back().first == i) {
+		labels.back().second = label;
+	} else {
+		labels.emplace_back(i, label);
+	}
+}
+
+bool Route::joined(size_t i) const {
+	return i > 0 && !std::binary_search(breaks.cbegin(), breaks.cend(), i);
+}
+
+bool Route::highlighted(size_t i) const {
+	return std::binary_search(highlights.cbegin(), highlights.cend(), i);
+}
+
+std::optional<uint32_t> Route::label(size_t i) const {
+	auto it = std::lower_bound(
+		labels.cbegin(), labels.cend(), i,
+		[](const auto &label, size_t i) { return label.first < i; }
+	);
+
+	if (it != labels.cend() && it->first == i) return it->second;
+	return std::nullopt;
+}
+
+const size_t SEGMENTS_PER_LEAF = 32;
+// in nmi, from fine to coarse
+const double LOD_TOLERANCES[] = { 0.05, 0.2, 0.8, 3.2, 12.8 };
+
+// generous allowance for the racetrack, in degrees of latitude
+static double hold_pad(const Hold &hold) {
+	return (hold.length + 4.0) / 60.0;
+}
+
+static double mercator_ordinate(double lat) {
+	double lat_rad = std::clamp(lat, -89.9, 89.9) * std::numbers::pi / 180.0;
+	return std::log(std::tan(std::numbers::pi / 4.0 + lat_rad / 2.0)) * 180.0 / std::numbers::pi;
+}
+
+// in nmi, on a plane local to the segment
+static double segment_length(double lat1, double lon1, double lat2, double lon2) {
+	double cos_lat = std::cos((lat1 + lat2) / 2.0 / DEG_PER_RAD);
+	return std::hypot((lon2 - lon1) * cos_lat * 60.0, (lat2 - lat1) * 60.0);
+}
+
+Plot::Plot(const std::string &_name, Route &&_route) :
+	route(std::move(_route)), name(strings.intern(_name))
+{
+	// a discontinuity at the end leaves a break past the last node, which
+	// joins nothing and is not a node index to save
+	if (!route.breaks.empty() && route.breaks.back() >= route.size()) route.breaks.pop_back();
+	if (route.empty()) return;
+
+	mercator.reserve(route.size());
+	for (float lat : route.lat) mercator.push_back(mercator_ordinate(lat));
+
+	along.reserve(route.size());
+	along.push_back(0.0);
+	for (size_t i = 1; i < route.size(); i++)
+		along.push_back(along.back() + (route.joined(i)
+			? segment_length(route.lat[i - 1], route.lon[i - 1], route.lat[i], route.lon[i])
+			: 0.0));
+	leaves.resize((route.size() - 1) / SEGMENTS_PER_LEAF + 1);
+
+	for (size_t i = 0; i < route.size(); i++) {
+		leaves[i / SEGMENTS_PER_LEAF].extend(route.lat[i], route.lon[i]);
+		if (i % SEGMENTS_PER_LEAF == 0 && i > 0)
+			leaves[i / SEGMENTS_PER_LEAF - 1].extend(route.lat[i], route.lon[i]);
+	}
+
+	for (const auto &[i, hold] : route.holds) {
+		hold_bounds.emplace_back();
+		hold_bounds.back().extend(route.lat[i], route.lon[i], hold_pad(hold));
+	}
+
+	for (const auto &leaf : leaves) bounds.extend(leaf);
+	for (const auto &hold : hold_bounds) bounds.extend(hold);
+
+	// the Douglas-Peucker deviation of each node, capped by that of the node
+	// which split its parent span so that coarser levels are subsets of finer
+	size_t n = route.size();
+	std::vector<float> deviation(n, 0.0f);
+
+	for (size_t i = 0; i < n; i++)
+		if (
+			i == 0 || i == n - 1 || !route.joined(i) || !route.joined(i + 1) ||
+			route.highlighted(i) || route.label(i)
+		) deviation[i] = INFINITY;
+	for (const auto &[i, _] : route.holds) deviation[i] = INFINITY;
+
+	struct Span {
+		size_t from, to;
+		float cap;
+	};
+
+	std::vector<Span> stack;
+
+	for (size_t a = 0, b = 1; b < n; b++) {
+		if (deviation[b] != INFINITY) {
+			if (route.joined(b) && b > a + 1) stack.push_back({ a, b, INFINITY });
+			a = b;
+		}
+
+		while (!stack.empty()) {
+			Span span = stack.back();
+			stack.pop_back();
+
+			// distances in nmi, on a plane local to the span
+			double cos_lat = std::cos((route.lat[span.from] + route.lat[span.to]) / 2.0 / DEG_PER_RAD);
+			double ax = route.lon[span.from] * cos_lat * 60.0, ay = route.lat[span.from] * 60.0;
+			double bx = route.lon[span.to] * cos_lat * 60.0, by = route.lat[span.to] * 60.0;
+			double dx = bx - ax, dy = by - ay, len2 = dx * dx + dy * dy;
+
+			size_t split = span.from + 1;
+			double max_dist = -1.0;
+
+			for (size_t i = span.from + 1; i < span.to; i++) {
+				double px = route.lon[i] * cos_lat * 60.0 - ax, py = route.lat[i] * 60.0 - ay;
+				double t = len2 > 0.0 ? std::clamp((px * dx + py * dy) / len2, 0.0, 1.0) : 0.0;
+				double dist = std::hypot(px - t * dx, py - t * dy);
+
+				if (dist > max_dist) {
+					max_dist = dist;
+					split = i;
+				}
+			}
+
+			float cap = std::min((float) max_dist, span.cap);
+			deviation[split] = cap;
+
+			if (split > span.from + 1) stack.push_back({ span.from, split, cap });
+			if (span.to > split + 1) stack.push_back({ split, span.to, cap });
+		}
+	}
+
+	size_t previous = n;
+
+	for (double tolerance : LOD_TOLERANCES) {
+		Level level;
+		level.tolerance = tolerance;
+
+		for (size_t i = 0; i < n; i++)
+			if (deviation[i] > tolerance) level.nodes.push_back(i);
+
+		// levels which barely simplify the one before are not worth keeping
+		if (level.nodes.size() > previous * 3 / 4) continue;
+		previous = level.nodes.size();
+
+		size_t m = level.nodes.size();
+		level.leaves.resize((m - 1) / SEGMENTS_PER_LEAF + 1);
+
+		for (size_t j = 0; j < m; j++) {
+			size_t i = level.nodes[j];
+
+			level.leaves[j / SEGMENTS_PER_LEAF].extend(route.lat[i], route.lon[i]);
+			if (j % SEGMENTS_PER_LEAF == 0 && j > 0)
+				level.leaves[j / SEGMENTS_PER_LEAF - 1].extend(route.lat[i], route.lon[i]);
+		}
+
+		levels.push_back(std::move(level));
+	}
+}
+
+void PlotMap::insert_or_assign(const std::string &name, PlotRef plot) {
+	auto it = index.find(name);
+	if (it != index.end()) {
+		it->second->second = std::move(plot);
+		return;
+	}
+
+	plots.emplace_back(name, std::move(plot));
+	index.emplace(plots.back().first, std::prev(plots.end()));
+}
+
+PlotMap::iterator PlotMap::erase(iterator it) {
+	index.erase(it->first);
+	return plots.erase(it);
+}
+
+void PlotMap::clear() {
+	index.clear();
+	plots.clear();
+}
+
+const Plot::Level *Plot::level(double tolerance) const {
+	const Level *best = nullptr;
+
+	for (const auto &level : levels)
+		if (level.tolerance <= tolerance) best = &level;
+
+	return best;
+}
+
+template<typename T>
+static size_t capacity_bytes(const std::vector<T> &v) {
+	return v.capacity() * sizeof(T);
+}
+
+size_t Plot::memory() const {
+	size_t bytes = sizeof(Plot)
+		+ capacity_bytes(route.lat) + capacity_bytes(route.lon)
+		+ capacity_bytes(route.breaks) + capacity_bytes(route.highlights)
+		+ capacity_bytes(route.labels) + capacity_bytes(route.holds)
+		+ capacity_bytes(mercator) + capacity_bytes(along)
+		+ capacity_bytes(leaves) + capacity_bytes(hold_bounds) + capacity_bytes(levels);
+
+	for (const auto &level : levels)
+		bytes += capacity_bytes(level.nodes) + capacity_bytes(level.leaves);
+
+	return bytes;
+}
+
+// the number of timings kept by each Samples
+const size_t SAMPLES_WINDOW = 512;
+
+void Samples::add(double ms) {
+	if (window.size() < SAMPLES_WINDOW) window.push_back(ms);
+	else window[next] = ms;
+
+	next = (next + 1) % SAMPLES_WINDOW;
+	total++;
+}
+
+double Samples::percentile(double p) const {
+	if (window.empty()) return 0.0;
+
+	std::vector<float> sorted(window);
+	auto nth = sorted.begin() + std::min((size_t) (p / 100.0 * sorted.size()), sorted.size() - 1);
+	std::nth_element(sorted.begin(), nth, sorted.end());
+
+	return *nth;
+}
+
+static double elapsed_ms(Clock::time_point since) {
+	return std::chrono::duration<double, std::milli>(Clock::now() - since).count();
+}
+
+
+
+void Screen::OnAsrContentLoaded(bool loaded) {
+	if (!loaded || !plugin) return;
+
+	if (const char *value = GetDataFromAsr("Hidden")) {
+		std::string names = unescape_asr(value);
+		for (auto name : tokenize(names)) hidden.emplace(name);
+	}
+
+	plugin->restore_plots(*this);
+}
+
+void Screen::OnAsrContentToBeSaved() {
+	if (!plugin) return;
+
+	std::string names;
+	for (const auto &name : hidden) names += (names.empty() ? "" : " ") + name;
+
+	SaveDataToAsr("Hidden", "Hidden plots and groups", escape_asr(names).c_str());
+	plugin->save_plots(*this);
+}
+
+void Screen::OnAsrContentToBeClosed() {
+	if (plugin) {
+		release_layers();
+		plugin->screens[i] = nullptr;
+	}
+
+	// GDI+ objects must not outlive GDI+ itself
+	resources.reset();
+
+	delete this;
+}
+
+const double HOLD_RADIUS = 2.0;
+const double STROKE_WIDTH = 1.0;
+const double LABEL_INTERVAL = 0.25;
+const int FONT_SIZE = 12;
+const int COLOUR_BANDS = 16;
+
+
+static Gdiplus::Color colour(double t) {
+	int x = 255.0 * (1.0 - std::abs(1.0 - t * 2.0));
+	return Gdiplus::Color(t < 0.5 ? 255 : x, 0, t > 0.5 ? 255 : x);
+}
+
+Screen::ProjectedHold Screen::project_hold(
+	size_t index, const Hold &hold, POINT point_ie, POINT point_is
+) {
+	long leg_x = point_is.x - point_ie.x, leg_y = point_is.y - point_ie.y;
+	double mul = HOLD_RADIUS / hold.length;
+	long rad_x = (double) leg_y * mul, rad_y = (double) -leg_x * mul;
+
+	long d = std::round(2.0 * std::sqrt(rad_x * rad_x + rad_y * rad_y)), r = d / 2;
+
+	double ang = std::atan((double) rad_y / (double) rad_x) * DEG_PER_RAD;
+	if (
+		(rad_x <= rad_y && rad_x <= -rad_y) ||
+		(rad_x < rad_y && rad_x > -rad_y && ang < 0) ||
+		(rad_x > rad_y && rad_x < -rad_y && ang > 0)
+	) ang += 180;
+
+	if (hold.left_turns) {
+		rad_x *= -1; rad_y *= -1;
+	}
+
+	POINT point_oc = point_ie, point_ic = point_is;
+
+	point_oc.x += rad_x; point_oc.y += rad_y;
+	point_ic.x += rad_x; point_ic.y += rad_y;
+
+	POINT point_os = point_oc, point_oe = point_ic;
+
+	point_os.x += rad_x; point_os.y += rad_y;
+	point_oe.x += rad_x; point_oe.y += rad_y;
+
+	return { index, point_oc, point_ic, point_os, point_oe, point_is, point_ie, d, r, ang };
+}
+
+// projects n nodes, given their longitudes and latitudes or Mercator ordinates
+static void project_batch(
+	const Transform &t, const float *lon, const float *v, size_t n, POINT *out
+) {
+	size_t i = 0;
+
+#ifdef __AVX__
+	__m256d ax4 = _mm256_set1_pd(t.ax), bx4 = _mm256_set1_pd(t.bx), cx4 = _mm256_set1_pd(t.cx);
+	__m256d ay4 = _mm256_set1_pd(t.ay), by4 = _mm256_set1_pd(t.by), cy4 = _mm256_set1_pd(t.cy);
+
+	for (; i + 4 <= n; i += 4) {
+		__m256d u = _mm256_cvtps_pd(_mm_loadu_ps(lon + i));
+		__m256d w = _mm256_cvtps_pd(_mm_loadu_ps(v + i));
+
+		__m128i x = _mm256_cvtpd_epi32(_mm256_add_pd(
+			_mm256_add_pd(_mm256_mul_pd(ax4, u), _mm256_mul_pd(bx4, w)), cx4
+		));
+		__m128i y = _mm256_cvtpd_epi32(_mm256_add_pd(
+			_mm256_add_pd(_mm256_mul_pd(ay4, u), _mm256_mul_pd(by4, w)), cy4
+		));
+
+		_mm_storeu_si128((__m128i *) (out + i), _mm_unpacklo_epi32(x, y));
+		_mm_storeu_si128((__m128i *) (out + i + 2), _mm_unpackhi_epi32(x, y));
+	}
+#endif
+
+#ifdef __SSE2__
+	__m128d ax = _mm_set1_pd(t.ax), bx = _mm_set1_pd(t.bx), cx = _mm_set1_pd(t.cx);
+	__m128d ay = _mm_set1_pd(t.ay), by = _mm_set1_pd(t.by), cy = _mm_set1_pd(t.cy);
+
+	for (; i + 2 <= n; i += 2) {
+		__m128d u = _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64((const __m128i *) (lon + i))));
+		__m128d w = _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64((const __m128i *) (v + i))));
+
+		__m128i x = _mm_cvtpd_epi32(_mm_add_pd(_mm_add_pd(_mm_mul_pd(ax, u), _mm_mul_pd(bx, w)), cx));
+		__m128i y = _mm_cvtpd_epi32(_mm_add_pd(_mm_add_pd(_mm_mul_pd(ay, u), _mm_mul_pd(by, w)), cy));
+
+		// POINT is a pair of 32-bit integers
+		_mm_storeu_si128((__m128i *) (out + i), _mm_unpacklo_epi32(x, y));
+	}
+#endif
+
+	for (; i < n; i++) out[i] = t.apply(lon[i], v[i]);
+}
+
+Bounds Screen::view_bounds(const RECT &area) {
+	// the edges of the view need not be lines of latitude or longitude, so
+	// the bounds are taken around points along them, plus a margin
+	Bounds visible;
+	for (int j = 0; j <= 4; j++) {
+		LONG x = area.left + (area.right - area.left) * j / 4;
+		LONG y = area.top + (area.bottom - area.top) * j / 4;
+
+		EuroScope::CPosition edges[4] = {
+			ConvertCoordFromPixelToPosition({ x, area.top }),
+			ConvertCoordFromPixelToPosition({ x, area.bottom }),
+			ConvertCoordFromPixelToPosition({ area.left, y }),
+			ConvertCoordFromPixelToPosition({ area.right, y }),
+		};
+
+		for (const auto &edge : edges) visible.extend(edge.m_Latitude, edge.m_Longitude);
+	}
+
+	double margin_lat = 0.1 * (visible.max_lat - visible.min_lat);
+	double margin_lon = 0.1 * (visible.max_lon - visible.min_lon);
+	visible.min_lat -= margin_lat; visible.max_lat += margin_lat;
+	visible.min_lon -= margin_lon; visible.max_lon += margin_lon;
+
+	return visible;
+}
+
+const double LOD_PIXEL_TOLERANCE = 0.5;
+const int PROJECTION_SAMPLES = 5;
+const double PROJECTION_TOLERANCE = 1.0;
+
+std::optional<Transform> Screen::fit_projection(const Bounds &visible) {
+	struct Sample {
+		double lat, lon;
+		POINT point;
+	};
+
+	std::vector<Sample> samples;
+	EuroScope::CPosition position;
+
+	for (int j = 0; j < PROJECTION_SAMPLES; j++) {
+		for (int k = 0; k < PROJECTION_SAMPLES; k++) {
+			position.m_Latitude = visible.min_lat
+				+ (visible.max_lat - visible.min_lat) * j / (PROJECTION_SAMPLES - 1);
+			position.m_Longitude = visible.min_lon
+				+ (visible.max_lon - visible.min_lon) * k / (PROJECTION_SAMPLES - 1);
+
+			samples.push_back({
+				position.m_Latitude, position.m_Longitude,
+				ConvertCoordFromPositionToPixel(position)
+			});
+		}
+	}
+
+	// least squares fits of each model, keeping whichever fits best
+	std::optional<Transform> best;
+	double best_error = INFINITY;
+
+	for (bool merc : { false, true }) {
+		double mu = 0.0, mv = 0.0, mx = 0.0, my = 0.0;
+		for (const auto &sample : samples) {
+			mu += sample.lon;
+			mv += merc ? mercator_ordinate(sample.lat) : sample.lat;
+			mx += sample.point.x;
+			my += sample.point.y;
+		}
+
+		mu /= samples.size(); mv /= samples.size();
+		mx /= samples.size(); my /= samples.size();
+
+		double suu = 0.0, suv = 0.0, svv = 0.0, sux = 0.0, svx = 0.0, suy = 0.0, svy = 0.0;
+		for (const auto &sample : samples) {
+			double u = sample.lon - mu, v = (merc ? mercator_ordinate(sample.lat) : sample.lat) - mv;
+			double x = sample.point.x - mx, y = sample.point.y - my;
+
+			suu += u * u; suv += u * v; svv += v * v;
+			sux += u * x; svx += v * x;
+			suy += u * y; svy += v * y;
+		}
+
+		double det = suu * svv - suv * suv;
+		if (!std::isfinite(det) || std::abs(det) < 1e-18) continue;
+
+		Transform t;
+		t.mercator = merc;
+		t.ax = (sux * svv - svx * suv) / det;
+		t.bx = (svx * suu - sux * suv) / det;
+		t.cx = mx - t.ax * mu - t.bx * mv;
+		t.ay = (suy * svv - svy * suv) / det;
+		t.by = (svy * suu - suy * suv) / det;
+		t.cy = my - t.ay * mu - t.by * mv;
+
+		double error = 0.0;
+		for (const auto &sample : samples) {
+			POINT point = t.apply(sample.lon, merc ? mercator_ordinate(sample.lat) : sample.lat);
+			error = std::max(error, (double) std::abs(point.x - sample.point.x));
+			error = std::max(error, (double) std::abs(point.y - sample.point.y));
+		}
+
+		if (error < best_error) {
+			best = t;
+			best_error = error;
+		}
+	}
+
+	if (best_error > PROJECTION_TOLERANCE) return std::nullopt;
+	return best;
+}
+
+POINT Screen::project(double lat, double lon) {
+	if (transform && projected_bounds.contains(lat, lon)) return transform->apply(lon, transform->mercator ? mercator_ordinate(lat) : lat);
+
+	EuroScope::CPosition position;
+	position.m_Latitude = lat;
+	position.m_Longitude = lon;
+
+	return ConvertCoordFromPositionToPixel(position);
+}
+
+void Screen::update_projection(const RECT &area) {
+	// any change to the view moves the corners of the radar area
+	EuroScope::CPosition view[2] = {
+		ConvertCoordFromPixelToPosition({ area.left, area.top }),
+		ConvertCoordFromPixelToPosition({ area.right, area.bottom }),
+	};
+
+	bool same_view = !std::memcmp(&area, &projected_area, sizeof(RECT));
+	for (int j = 0; j <= 1; j++)
+		same_view = same_view
+			&& view[j].m_Latitude == projected_view[j].m_Latitude
+			&& view[j].m_Longitude == projected_view[j].m_Longitude;
+
+	if (same_view && projected_version == plugin->routes_version) return;
+
+	projected_version = plugin->routes_version;
+
+	// with the same view, only the plots which have changed are projected
+	// again, and only the layers they were or are drawn in redrawn
+	if (same_view) {
+		for (auto it = projected.begin(); it != projected.end();) {
+			auto plot = plugin->routes.find(it->first);
+			if (
+				plot != plugin->routes.end() && plot->second == it->second.plot &&
+				plugin->group_of(it->first) == it->second.group
+			) {
+				it++;
+				continue;
+			}
+
+			if (!it->second.empty()) invalidate_layer(it->second.group);
+			it = projected.erase(it);
+		}
+
+		for (const auto &[name, plot] : plugin->routes) {
+			auto [it, inserted] = projected.try_emplace(name);
+			if (!inserted) continue;
+
+			project_route(name, plot, it->second);
+			if (!it->second.empty()) invalidate_layer(it->second.group);
+		}
+
+		return;
+	}
+
+	projected_area = area;
+	projected_view[0] = view[0];
+	projected_view[1] = view[1];
+
+	Bounds visible = view_bounds(area);
+	projected_bounds = visible;
+
+	// nodes are projected in bulk when the projection fits an affine
+	// transform, falling back to EuroScope node by node otherwise
+	transform = fit_projection(visible);
+
+	double centre_lat = (visible.min_lat + visible.max_lat) / 2.0;
+	double centre_lon = (visible.min_lon + visible.max_lon) / 2.0;
+	POINT centre = project(centre_lat, centre_lon);
+	POINT north = project(centre_lat + 10.0 / DEG_LAT_PER_NM, centre_lon);
+	projected_scale = std::max(std::hypot(north.x - centre.x, north.y - centre.y) / 10.0, 1e-6);
+
+	projected.clear();
+	for (auto &[_, layer] : layers) layer.valid = false;
+
+	for (const auto &[name, plot] : plugin->routes)
+		project_route(name, plot, projected[name]);
+}
+
+bool Screen::shows(const Bounds &bounds) const {
+	return projected_version == 0 || projected_bounds.intersects(bounds);
+}
+
+void Screen::project_route(const std::string &name, const PlotRef &ref, ProjectedRoute &proj) {
+	const Bounds &visible = projected_bounds;
+	double px_per_nm = projected_scale;
+
+	proj.plot = ref;
+	proj.group = plugin->group_of(name);
+	if (hidden.count(name) || hidden.count(proj.group)) return;
+
+	const Plot &plot = *ref;
+	if (!plot.bounds.intersects(visible)) return;
+
+	const Route &route = plot.route;
+
+	// the simplified route is used when its deviations are under a pixel
+	const Plot::Level *level = plot.level(LOD_PIXEL_TOLERANCE / px_per_nm);
+	const auto &leaves = level ? level->leaves : plot.leaves;
+	size_t count = level ? level->nodes.size() : route.size();
+	auto node = [level](size_t j) -> size_t { return level ? level->nodes[j] : j; };
+
+	// the nodes of one leaf at a time, each projected at most once
+	std::array<POINT, SEGMENTS_PER_LEAF + 1> points;
+	std::array<bool, SEGMENTS_PER_LEAF + 1> done;
+
+	for (size_t k = 0; k < leaves.size(); k++) {
+		if (!leaves[k].intersects(visible)) continue;
+
+		size_t first = k * SEGMENTS_PER_LEAF;
+		size_t last = std::min(first + SEGMENTS_PER_LEAF, count - 1);
+
+		done.fill(false);
+		auto point = [&](size_t j) {
+			if (!done[j - first]) {
+				done[j - first] = true;
+				points[j - first] = project(route.lat[node(j)], route.lon[node(j)]);
+			}
+
+			return points[j - first];
+		};
+
+		// the full route is contiguous, so can be projected in bulk, as long
+		// as the leaf is within the fitted area
+		if (transform && !level && visible.contains(leaves[k])) {
+			project_batch(
+				*transform,
+				route.lon.data() + first,
+				(transform->mercator ? plot.mercator : route.lat).data() + first,
+				last - first + 1,
+				points.data()
+			);
+
+			done.fill(true);
+		}
+
+		for (size_t j = first; j <= last; j++) {
+			size_t i = node(j);
+
+			// levels keep both ends of each run, so only the last node can
+			// start a new one
+			if (j > first && route.joined(i)) {
+				size_t prev = node(j - 1);
+
+				Bounds segment;
+				segment.extend(route.lat[prev], route.lon[prev]);
+				segment.extend(route.lat[i], route.lon[i]);
+
+				if (segment.intersects(visible))
+					proj.segments.push_back({ (uint32_t) prev, (uint32_t) i, point(j - 1), point(j) });
+			}
+
+			// the last node of a leaf is the first of the next
+			if (j == last && k + 1 < leaves.size()) continue;
+
+			if (visible.contains(route.lat[i], route.lon[i]))
+				proj.nodes.push_back({ (uint32_t) i, point(j) });
+		}
+	}
+
+	// the inbound legs of all visible holds are projected together, except
+	// those starting outside the fitted area
+	std::vector<const std::pair<uint32_t, Hold> *> holds;
+	std::vector<size_t> fitted;
+	std::vector<float> start_lon, start_v;
+
+	for (size_t h = 0; h < route.holds.size(); h++) {
+		if (!plot.hold_bounds[h].intersects(visible)) continue;
+
+		const auto &entry = route.holds[h];
+		const auto &[i, hold] = entry;
+
+		if (transform && visible.contains(hold.start_lat, hold.start_lon)) {
+			fitted.push_back(holds.size());
+			start_lon.push_back(hold.start_lon);
+			start_v.push_back(
+				transform->mercator ? mercator_ordinate(hold.start_lat) : hold.start_lat
+			);
+		}
+
+		holds.push_back(&entry);
+	}
+
+	std::vector<POINT> starts(holds.size()), batch(fitted.size());
+	if (transform) project_batch(*transform, start_lon.data(), start_v.data(), fitted.size(), batch.data());
+
+	for (size_t j = 0, f = 0; j < holds.size(); j++) {
+		if (f < fitted.size() && fitted[f] == j) starts[j] = batch[f++];
+		else starts[j] = project(holds[j]->second.start_lat, holds[j]->second.start_lon);
+	}
+
+	for (size_t j = 0; j < holds.size(); j++) {
+		const auto &[i, hold] = *holds[j];
+		proj.holds.push_back(project_hold(i, hold, project(route.lat[i], route.lon[i]), starts[j]));
+	}
+
+	project_labels(plot, proj);
+}
+
+size_t Screen::ProjectedRoute::memory() const {
+	return sizeof(ProjectedRoute) + group.capacity()
+		+ capacity_bytes(segments) + capacity_bytes(nodes)
+		+ capacity_bytes(holds) + capacity_bytes(labels);
+}
+
+void Screen::project_labels(const Plot &plot, ProjectedRoute &proj) {
+	const Route &route = plot.route;
+	const std::vector<double> &along = plot.along;
+
+	// labels sit at whole multiples of the interval along the route, so they
+	// stay in place as the view is panned
+	double interval = LABEL_INTERVAL * (double) (projected_area.bottom - projected_area.top) / projected_scale;
+	if (!(interval > 0.0) || !std::isfinite(interval)) return;
+
+	for (size_t k = 0; k < plot.leaves.size(); k++) {
+		if (!plot.leaves[k].intersects(projected_bounds)) continue;
+
+		size_t first = k * SEGMENTS_PER_LEAF;
+		size_t last = std::min(first + SEGMENTS_PER_LEAF, route.size() - 1);
+
+		// each leaf takes the labels from its first node up to its last
+		for (
+			double target = std::max(std::ceil(along[first] / interval), 1.0) * interval;
+			target < along[last];
+			target += interval
+		) {
+			// the first node beyond the label ends a joined segment, as breaks
+			// add no distance
+			size_t i = std::upper_bound(
+				along.begin() + first + 1, along.begin() + last + 1, target
+			) - along.begin();
+			double t = (target - along[i - 1]) / (along[i] - along[i - 1]);
+
+			POINT point1 = project(route.lat[i - 1], route.lon[i - 1]);
+			POINT point2 = project(route.lat[i], route.lon[i]);
+
+			double x = (1.0 - t) * point1.x + t * point2.x, y = (1.0 - t) * point1.y + t * point2.y;
+			if (
+				x < projected_area.left || x >= projected_area.right ||
+				y < projected_area.top || y >= projected_area.bottom
+			) continue;
+
+			proj.labels.push_back({
+				x, y, std::atan((double) (point1.y - point2.y) / (double) (point2.x - point1.x))
+			});
+		}
+	}
+}
+
+std::string Screen::validate_projection() {
+	RECT area = GetRadarArea();
+	Bounds visible = view_bounds(area);
+	auto fit = fit_projection(visible);
+
+	if (!fit) return std::string("no affine fit within tolerance; using EuroScope projection");
+
+	size_t count = 0, over = 0;
+	long max_error = 0;
+	std::vector<POINT> points;
+	EuroScope::CPosition position;
+
+	for (const auto &[_, plot] : plugin->routes) {
+		const Route &route = plot->route;
+
+		points.resize(route.size());
+		project_batch(
+			*fit, route.lon.data(), (fit->mercator ? plot->mercator : route.lat).data(),
+			route.size(), points.data()
+		);
+
+		// nodes beyond the fitted area are projected by EuroScope
+		for (size_t i = 0; i < route.size(); i++) {
+			if (!visible.contains(route.lat[i], route.lon[i])) continue;
+
+			position.m_Latitude = route.lat[i];
+			position.m_Longitude = route.lon[i];
+
+			POINT point = ConvertCoordFromPositionToPixel(position);
+			long error = std::max(std::abs(point.x - points[i].x), std::abs(point.y - points[i].y));
+
+			max_error = std::max(max_error, error);
+			if (error > PROJECTION_TOLERANCE) over++;
+			count++;
+		}
+	}
+
+	return std::format(
+		"{} fit; {} nodes in view, max error {} px, {} beyond tolerance",
+		fit->mercator ? "Mercator" : "equirectangular", count, max_error, over
+	);
+}
+
+// the layers of all screens together are kept within this many bytes
+const size_t LAYER_MEMORY_LIMIT = 64 << 20;
+
+bool Screen::reserve_layer(size_t bytes) {
+	if (bytes > LAYER_MEMORY_LIMIT) return false;
+
+	// evict the least recently drawn layers of other screens
+	while (plugin->layer_bytes + bytes > LAYER_MEMORY_LIMIT) {
+		Screen *lru_screen = nullptr;
+		Layer *lru = nullptr;
+		for (auto screen : plugin->screens)
+			if (screen && screen != this)
+				for (auto &[_, layer] : screen->layers)
+					if (layer.bitmap && (!lru || layer.used < lru->used)) {
+						lru_screen = screen;
+						lru = &layer;
+					}
+
+		if (!lru) return false;
+		lru_screen->release_layer(*lru);
+	}
+
+	plugin->layer_bytes += bytes;
+	return true;
+}
+
+void Screen::release_layer(Layer &layer) {
+	if (!layer.bitmap) return;
+
+	plugin->layer_bytes -= (size_t) layer.bitmap->GetWidth() * (size_t) layer.bitmap->GetHeight() * 4;
+	layer.bitmap.reset();
+}
+
+void Screen::release_layers() {
+	for (auto &[_, layer] : layers) release_layer(layer);
+	layers.clear();
+}
+
+void Screen::invalidate_layer(std::string_view group) {
+	auto layer = layers.find(group);
+	if (layer != layers.end()) layer->second.valid = false;
+}
+
+Screen::Resources::Resources(HDC _hdc, const RECT &area) :
+	hdc(_hdc),
+	width(area.right - area.left), height(area.bottom - area.top),
+	screen_width(GetDeviceCaps(_hdc, HORZRES)), screen_height(GetDeviceCaps(_hdc, VERTRES)),
+	ctx(Gdiplus::Graphics::FromHDC(_hdc)),
+	font_family(L"EuroScope"),
+	font(&font_family, FONT_SIZE, Gdiplus::FontStyleRegular, Gdiplus::UnitPixel),
+	pen(colour(0.0), STROKE_WIDTH), brush_pen(colour(0.0), STROKE_WIDTH),
+	name_brush(Gdiplus::Color(0xdd, 0xdd, 0xdd)), label_brush(Gdiplus::Color(0xff, 0xff, 0xff))
+{
+	for (int b = 0; b < COLOUR_BANDS; b++)
+		ramp_pens.push_back(std::make_unique<Gdiplus::Pen>(
+			colour(((double) b + 0.5) / (double) COLOUR_BANDS), STROKE_WIDTH
+		));
+}
+
+bool Screen::Resources::matches(HDC _hdc, const RECT &area) const {
+	return hdc == _hdc
+		&& width == area.right - area.left && height == area.bottom - area.top
+		&& screen_width == GetDeviceCaps(_hdc, HORZRES)
+		&& screen_height == GetDeviceCaps(_hdc, VERTRES);
+}
+
+const Gdiplus::RectF &Screen::Resources::measure(Gdiplus::Graphics *ctx, uint32_t id) {
+	auto &extents = plugin->label_extents;
+	if (extents.size() <= id) extents.resize(strings.size());
+
+	if (!extents[id]) {
+		Gdiplus::RectF extent;
+		ctx->MeasureString(strings[id].c_str(), -1, &font, Gdiplus::PointF(0, 0), &extent);
+		extents[id] = extent;
+	}
+
+	return *extents[id];
+}
+
+class Screen::GdiplusRenderer : public Renderer {
+private:
+	Gdiplus::Graphics *ctx;
+	Resources &resources;
+	Gdiplus::GraphicsPath bands[COLOUR_BANDS];
+
+public:
+	GdiplusRenderer(Gdiplus::Graphics *_ctx, Resources &_resources) : ctx(_ctx), resources(_resources) {}
+
+	void DrawLine(POINT, POINT, Gdiplus::Color) override;
+	void DrawGradientLine(POINT, POINT, Gdiplus::Color, Gdiplus::Color) override;
+	void DrawArc(POINT, long, double, double, Gdiplus::Color) override;
+	void DrawEllipse(POINT, int, Gdiplus::Color) override;
+	void AddBandLine(int, POINT, POINT, bool) override;
+	void DrawBands(void) override;
+	void DrawString(uint32_t, Gdiplus::PointF, double, TextStyle) override;
+	const Gdiplus::RectF &MeasureString(uint32_t) override;
+};
+
+void Screen::GdiplusRenderer::DrawLine(POINT a, POINT b, Gdiplus::Color colour) {
+	resources.pen.SetColor(colour);
+	ctx->DrawLine(&resources.pen, a.x, a.y, b.x, b.y);
+}
+
+void Screen::GdiplusRenderer::DrawGradientLine(POINT a, POINT b, Gdiplus::Color from, Gdiplus::Color to) {
+	auto line_brush = Gdiplus::LinearGradientBrush(Gdiplus::Point(a.x, a.y), Gdiplus::Point(b.x, b.y), from, to);
+	resources.brush_pen.SetBrush(&line_brush);
+
+	ctx->DrawLine(&resources.brush_pen, a.x, a.y, b.x, b.y);
+}
+
+void Screen::GdiplusRenderer::DrawArc(POINT corner, long size, double start, double sweep, Gdiplus::Color colour) {
+	resources.pen.SetColor(colour);
+	ctx->DrawArc(&resources.pen, corner.x, corner.y, size, size, start, sweep);
+}
+
+void Screen::GdiplusRenderer::DrawEllipse(POINT centre, int r, Gdiplus::Color colour) {
+	resources.pen.SetColor(colour);
+	ctx->DrawEllipse(&resources.pen, centre.x - r, centre.y - r, r * 2, r * 2);
+}
+
+void Screen::GdiplusRenderer::AddBandLine(int band, POINT a, POINT b, bool start_figure) {
+	if (start_figure) bands[band].StartFigure();
+	bands[band].AddLine(a.x, a.y, b.x, b.y);
+}
+
+void Screen::GdiplusRenderer::DrawBands() {
+	for (int b = 0; b < COLOUR_BANDS; b++)
+		ctx->DrawPath(resources.ramp_pens[b].get(), &bands[b]);
+}
+
+void Screen::GdiplusRenderer::DrawString(uint32_t id, Gdiplus::PointF origin, double angle, TextStyle style) {
+	Gdiplus::GraphicsState state;
+
+	if (angle != 0.0) {
+		state = ctx->Save();
+
+		ctx->TranslateTransform(origin.X, origin.Y);
+		ctx->RotateTransform(angle);
+		ctx->TranslateTransform(-origin.X, -origin.Y);
+	}
+
+	ctx->DrawString(
+		strings[id].c_str(), -1, &resources.font, origin,
+		style == TEXT_NAME ? &resources.name_brush : &resources.label_brush
+	);
+
+	if (angle != 0.0) ctx->Restore(state);
+}
+
+const Gdiplus::RectF &Screen::GdiplusRenderer::MeasureString(uint32_t id) {
+	return resources.measure(ctx, id);
+}
+
+static D2D1_COLOR_F d2d_colour(Gdiplus::Color colour) {
+	return D2D1::ColorF(
+		colour.GetR() / 255.0f, colour.GetG() / 255.0f, colour.GetB() / 255.0f, colour.GetA() / 255.0f
+	);
+}
+
+// through the centre of the pixel, as GDI+ draws 1 px lines
+static D2D1_POINT_2F d2d_point(POINT point) {
+	return D2D1::Point2F(point.x + 0.5f, point.y + 0.5f);
+}
+
+// as D2D1::Matrix3x2F::Rotation, which is imported from d2d1.dll
+static D2D1::Matrix3x2F d2d_rotation(double degrees, Gdiplus::PointF centre) {
+	float c = (float) std::cos(degrees / DEG_PER_RAD), s = (float) std::sin(degrees / DEG_PER_RAD);
+
+	return D2D1::Matrix3x2F(
+		c, s, -s, c,
+		centre.X - c * centre.X + s * centre.Y, centre.Y - s * centre.X - c * centre.Y
+	);
+}
+
+using D2D1CreateFactoryProc = HRESULT (WINAPI *)(D2D1_FACTORY_TYPE, REFIID, const D2D1_FACTORY_OPTIONS *, void **);
+using DWriteCreateFactoryProc = HRESULT (WINAPI *)(DWRITE_FACTORY_TYPE, REFIID, IUnknown **);
+
+std::unique_ptr<Screen::Direct2D> Screen::Direct2D::create() {
+	// the libraries are loaded at run time, so the plugin still loads, and
+	// draws with GDI+, where they are missing; they are kept loaded once used
+	static HMODULE d2d1 = LoadLibraryW(L"d2d1.dll"), dwrite = LoadLibraryW(L"dwrite.dll");
+	if (!d2d1 || !dwrite) return nullptr;
+
+	auto create_d2d_factory = (D2D1CreateFactoryProc) GetProcAddress(d2d1, "D2D1CreateFactory");
+	auto create_dwrite_factory = (DWriteCreateFactoryProc) GetProcAddress(dwrite, "DWriteCreateFactory");
+	if (!create_d2d_factory || !create_dwrite_factory) return nullptr;
+
+	auto d2d = std::make_unique<Direct2D>();
+
+	// pixels are used throughout, rather than device-independent units
+	auto properties = D2D1::RenderTargetProperties(
+		D2D1_RENDER_TARGET_TYPE_DEFAULT,
+		D2D1::PixelFormat(DXGI_FORMAT_B8G8R8A8_UNORM, D2D1_ALPHA_MODE_IGNORE),
+		96.0f, 96.0f
+	);
+
+	ID2D1Factory *factory;
+	if (FAILED(create_d2d_factory(
+		D2D1_FACTORY_TYPE_SINGLE_THREADED, __uuidof(ID2D1Factory), nullptr, (void **) &factory
+	))) return nullptr;
+	d2d->factory.reset(factory);
+
+	ID2D1DCRenderTarget *target;
+	if (FAILED(factory->CreateDCRenderTarget(&properties, &target))) return nullptr;
+	d2d->target.reset(target);
+
+	auto solid_brush = [target](Gdiplus::Color colour, ComPtr<ID2D1SolidColorBrush> &brush) {
+		ID2D1SolidColorBrush *created;
+		if (FAILED(target->CreateSolidColorBrush(d2d_colour(colour), &created))) return false;
+
+		brush.reset(created);
+		return true;
+	};
+
+	if (
+		!solid_brush(colour(0.0), d2d->brush) ||
+		!solid_brush(Gdiplus::Color(0xdd, 0xdd, 0xdd), d2d->name_brush) ||
+		!solid_brush(Gdiplus::Color(0xff, 0xff, 0xff), d2d->label_brush)
+	) return nullptr;
+
+	d2d->ramp_brushes.resize(COLOUR_BANDS);
+	for (int b = 0; b < COLOUR_BANDS; b++)
+		if (!solid_brush(colour(((double) b + 0.5) / (double) COLOUR_BANDS), d2d->ramp_brushes[b]))
+			return nullptr;
+
+	IDWriteFactory *write_factory;
+	if (FAILED(create_dwrite_factory(
+		DWRITE_FACTORY_TYPE_SHARED, __uuidof(IDWriteFactory), (IUnknown **) &write_factory
+	))) return nullptr;
+	d2d->write_factory.reset(write_factory);
+
+	IDWriteTextFormat *format;
+	if (FAILED(write_factory->CreateTextFormat(
+		L"EuroScope", nullptr,
+		DWRITE_FONT_WEIGHT_NORMAL, DWRITE_FONT_STYLE_NORMAL, DWRITE_FONT_STRETCH_NORMAL,
+		FONT_SIZE, L"", &format
+	))) return nullptr;
+	d2d->format.reset(format);
+	format->SetWordWrapping(DWRITE_WORD_WRAPPING_NO_WRAP);
+
+	return d2d;
+}
+
+IDWriteTextLayout *Screen::Direct2D::layout(uint32_t id) {
+	if (layouts.size() <= id) {
+		layouts.resize(strings.size());
+		extents.resize(strings.size());
+	}
+
+	if (!layouts[id]) {
+		const std::wstring &str = strings[id];
+		IDWriteTextLayout *created;
+
+		if (FAILED(write_factory->CreateTextLayout(
+			str.c_str(), str.size(), format.get(), 4096.0f, 4096.0f, &created
+		))) return nullptr;
+
+		layouts[id].reset(created);
+	}
+
+	return layouts[id].get();
+}
+
+class Screen::Direct2DRenderer : public Renderer {
+private:
+	Direct2D &d2d;
+	ComPtr<ID2D1PathGeometry> bands[COLOUR_BANDS];
+	ComPtr<ID2D1GeometrySink> sinks[COLOUR_BANDS];
+	bool open[COLOUR_BANDS] = {};
+
+public:
+	Direct2DRenderer(Direct2D &_d2d) : d2d(_d2d) {}
+
+	void DrawLine(POINT, POINT, Gdiplus::Color) override;
+	void DrawGradientLine(POINT, POINT, Gdiplus::Color, Gdiplus::Color) override;
+	void DrawArc(POINT, long, double, double, Gdiplus::Color) override;
+	void DrawEllipse(POINT, int, Gdiplus::Color) override;
+	void AddBandLine(int, POINT, POINT, bool) override;
+	void DrawBands(void) override;
+	void DrawString(uint32_t, Gdiplus::PointF, double, TextStyle) override;
+	const Gdiplus::RectF &MeasureString(uint32_t) override;
+};
+
+void Screen::Direct2DRenderer::DrawLine(POINT a, POINT b, Gdiplus::Color colour) {
+	d2d.brush->SetColor(d2d_colour(colour));
+	d2d.target->DrawLine(d2d_point(a), d2d_point(b), d2d.brush.get(), STROKE_WIDTH);
+}
+
+void Screen::Direct2DRenderer::DrawGradientLine(POINT a, POINT b, Gdiplus::Color from, Gdiplus::Color to) {
+	D2D1_GRADIENT_STOP stops[2] = { { 0.0f, d2d_colour(from) }, { 1.0f, d2d_colour(to) } };
+
+	ID2D1GradientStopCollection *collection;
+	if (FAILED(d2d.target->CreateGradientStopCollection(stops, 2, &collection))) return;
+	ComPtr<ID2D1GradientStopCollection> stop_collection(collection);
+
+	ID2D1LinearGradientBrush *brush;
+	if (FAILED(d2d.target->CreateLinearGradientBrush(
+		D2D1::LinearGradientBrushProperties(d2d_point(a), d2d_point(b)), collection, &brush
+	))) return;
+	ComPtr<ID2D1LinearGradientBrush> line_brush(brush);
+
+	d2d.target->DrawLine(d2d_point(a), d2d_point(b), brush, STROKE_WIDTH);
+}
+
+void Screen::Direct2DRenderer::DrawArc(POINT corner, long size, double start, double sweep, Gdiplus::Color colour) {
+	double r = size / 2.0, cx = corner.x + r + 0.5, cy = corner.y + r + 0.5;
+	double a = start / DEG_PER_RAD, b = (start + sweep) / DEG_PER_RAD;
+
+	ID2D1PathGeometry *geometry;
+	if (FAILED(d2d.factory->CreatePathGeometry(&geometry))) return;
+	ComPtr<ID2D1PathGeometry> path(geometry);
+
+	ID2D1GeometrySink *geometry_sink;
+	if (FAILED(geometry->Open(&geometry_sink))) return;
+	ComPtr<ID2D1GeometrySink> sink(geometry_sink);
+
+	sink->BeginFigure(
+		D2D1::Point2F(cx + r * std::cos(a), cy + r * std::sin(a)), D2D1_FIGURE_BEGIN_HOLLOW
+	);
+	sink->AddArc(D2D1::ArcSegment(
+		D2D1::Point2F(cx + r * std::cos(b), cy + r * std::sin(b)),
+		D2D1::SizeF(r, r), 0.0f,
+		sweep > 0 ? D2D1_SWEEP_DIRECTION_CLOCKWISE : D2D1_SWEEP_DIRECTION_COUNTER_CLOCKWISE,
+		std::abs(sweep) > 180.0 ? D2D1_ARC_SIZE_LARGE : D2D1_ARC_SIZE_SMALL
+	));
+	sink->EndFigure(D2D1_FIGURE_END_OPEN);
+	if (FAILED(sink->Close())) return;
+
+	d2d.brush->SetColor(d2d_colour(colour));
+	d2d.target->DrawGeometry(geometry, d2d.brush.get(), STROKE_WIDTH);
+}
+
+void Screen::Direct2DRenderer::DrawEllipse(POINT centre, int r, Gdiplus::Color colour) {
+	d2d.brush->SetColor(d2d_colour(colour));
+	d2d.target->DrawEllipse(D2D1::Ellipse(d2d_point(centre), r, r), d2d.brush.get(), STROKE_WIDTH);
+}
+
+void Screen::Direct2DRenderer::AddBandLine(int band, POINT a, POINT b, bool start_figure) {
+	if (!sinks[band]) {
+		ID2D1PathGeometry *geometry;
+		if (FAILED(d2d.factory->CreatePathGeometry(&geometry))) return;
+		bands[band].reset(geometry);
+
+		ID2D1GeometrySink *sink;
+		if (FAILED(geometry->Open(&sink))) return;
+		sinks[band].reset(sink);
+	}
+
+	if (start_figure || !open[band]) {
+		if (open[band]) sinks[band]->EndFigure(D2D1_FIGURE_END_OPEN);
+		sinks[band]->BeginFigure(d2d_point(a), D2D1_FIGURE_BEGIN_HOLLOW);
+		open[band] = true;
+	}
+
+	sinks[band]->AddLine(d2d_point(b));
+}
+
+void Screen::Direct2DRenderer::DrawBands() {
+	for (int b = 0; b < COLOUR_BANDS; b++) {
+		if (!sinks[b]) continue;
+
+		if (open[b]) sinks[b]->EndFigure(D2D1_FIGURE_END_OPEN);
+		open[b] = false;
+
+		bool closed = SUCCEEDED(sinks[b]->Close());
+		sinks[b].reset();
+
+		if (closed) d2d.target->DrawGeometry(bands[b].get(), d2d.ramp_brushes[b].get(), STROKE_WIDTH);
+		bands[b].reset();
+	}
+}
+
+void Screen::Direct2DRenderer::DrawString(uint32_t id, Gdiplus::PointF origin, double angle, TextStyle style) {
+	IDWriteTextLayout *layout = d2d.layout(id);
+	if (!layout) return;
+
+	D2D1_MATRIX_3X2_F transform;
+	if (angle != 0.0) {
+		d2d.target->GetTransform(&transform);
+		d2d.target->SetTransform(
+			d2d_rotation(angle, origin) *
+			*D2D1::Matrix3x2F::ReinterpretBaseType(&transform)
+		);
+	}
+
+	d2d.target->DrawTextLayout(
+		D2D1::Point2F(origin.X, origin.Y), layout,
+		style == TEXT_NAME ? d2d.name_brush.get() : d2d.label_brush.get()
+	);
+
+	if (angle != 0.0) d2d.target->SetTransform(transform);
+}
+
+const Gdiplus::RectF &Screen::Direct2DRenderer::MeasureString(uint32_t id) {
+	IDWriteTextLayout *layout = d2d.layout(id);
+	std::optional<Gdiplus::RectF> &extent = d2d.extents[id];
+
+	if (!extent) {
+		DWRITE_TEXT_METRICS metrics = {};
+		if (layout) layout->GetMetrics(&metrics);
+
+		extent = Gdiplus::RectF(metrics.left, metrics.top, metrics.widthIncludingTrailingWhitespace, metrics.height);
+	}
+
+	return *extent;
+}
+
+
+
+void Screen::OnRefresh(HDC hdc, int phase) {
+	if (phase != EuroScope::REFRESH_PHASE_BACK_BITMAP) return;
+
+	plugin->scan_navdata();
+
+	if (plugin->routes.empty()) {
+		release_layers();
+		// the view isn't followed while there is nothing to draw, and the
+		// projections are dropped so they don't keep cleared plots alive
+		projected.clear();
+		transform = std::nullopt;
+		projected_version = 0;
+		return;
+	}
+
+	Clock::time_point start = Clock::now();
+	refresh_times = {};
+
+	draw(hdc);
+	record_refresh(elapsed_ms(start));
+}
+
+void Screen::draw(HDC hdc) {
+	using namespace Gdiplus;
+
+	RECT rect = GetRadarArea();
+
+	if (plugin->direct2d && !direct2d_failed) {
+		if (!direct2d && !(direct2d = Direct2D::create())) {
+			direct2d_failed = true;
+			plugin->display_message("Error", "Direct2D is unavailable, so GDI+ will be used", true);
+		}
+
+		if (direct2d) {
+			draw_direct2d(hdc, rect);
+			return;
+		}
+	}
+
+	Rect clip(rect.left, rect.top, rect.right - rect.left, rect.bottom - rect.top);
+	size_t bytes = (size_t) clip.Width * (size_t) clip.Height * 4;
+
+	if (!resources || !resources->matches(hdc, rect))
+		resources = std::make_unique<Resources>(hdc, rect);
+
+	Graphics *ctx = resources->ctx.get();
+	ctx->SetClip(clip);
+
+	// the routes only change on commands, so each group is drawn once to a
+	// layer which is reused until its routes or the view change
+	Clock::time_point start = Clock::now();
+	update_projection(rect);
+	refresh_times.projection = elapsed_ms(start);
+
+	if (layer_smooth != plugin->smooth_gradients)
+		for (auto &[_, layer] : layers) layer.valid = false;
+	layer_smooth = plugin->smooth_gradients;
+
+	// hidden and off-screen plots have nothing projected, so cost no layer
+	std::set<std::string_view> groups = visible_groups();
+
+	for (auto it = layers.begin(); it != layers.end();) {
+		if (groups.count(it->first)) {
+			it++;
+			continue;
+		}
+
+		release_layer(it->second);
+		it = layers.erase(it);
+	}
+
+	for (std::string_view group : groups) {
+		Layer &layer = layers.try_emplace(std::string(group)).first->second;
+
+		if (layer.bitmap)
+			if (layer.bitmap->GetWidth() != (UINT) clip.Width || layer.bitmap->GetHeight() != (UINT) clip.Height)
+				release_layer(layer);
+
+		if (!layer.bitmap && bytes > 0 && reserve_layer(bytes)) {
+			layer.bitmap = std::make_unique<Bitmap>(clip.Width, clip.Height, PixelFormat32bppPARGB);
+			layer.valid = false;
+
+			if (layer.bitmap->GetLastStatus() != Ok) {
+				layer.bitmap.reset();
+				plugin->layer_bytes -= bytes;
+			}
+		}
+
+		if (!layer.bitmap) {
+			GdiplusRenderer renderer(ctx, *resources);
+			draw_routes(renderer, rect, group);
+			continue;
+		}
+
+		if (!layer.valid) {
+			Graphics layer_ctx(layer.bitmap.get());
+			layer_ctx.Clear(Color(0, 0, 0, 0));
+			layer_ctx.SetTextRenderingHint(TextRenderingHintAntiAlias);
+			layer_ctx.TranslateTransform(-rect.left, -rect.top);
+
+			GdiplusRenderer renderer(&layer_ctx, *resources);
+			draw_routes(renderer, rect, group);
+			layer.valid = true;
+		}
+
+		layer.used = ++plugin->layer_clock;
+		ctx->DrawImage(layer.bitmap.get(), clip.X, clip.Y, clip.Width, clip.Height);
+	}
+}
+
+void Screen::record_refresh(double ms) {
+	const RefreshTimes &times = refresh_times;
+
+	refresh_samples.add(ms);
+	projection_samples.add(times.projection);
+	lines_samples.add(times.lines);
+	holds_samples.add(times.holds);
+	labels_samples.add(times.labels);
+
+	if (!plugin->trace.is_open()) return;
+
+	std::string screen = std::to_string(i + 1);
+	plugin->record_trace("refresh", screen, "total", ms);
+	plugin->record_trace("refresh", screen, "projection", times.projection);
+	plugin->record_trace("refresh", screen, "lines", times.lines);
+	plugin->record_trace("refresh", screen, "holds", times.holds);
+	plugin->record_trace("refresh", screen, "labels", times.labels);
+}
+
+std::set<std::string_view> Screen::visible_groups() const {
+	std::set<std::string_view> groups;
+	for (const auto &[_, proj] : projected)
+		if (!proj.empty()) groups.insert(proj.group);
+
+	return groups;
+}
+
+// Direct2D rasterises quickly enough to draw every refresh, so keeps no layers
+void Screen::draw_direct2d(HDC hdc, const RECT &rect) {
+	Clock::time_point start = Clock::now();
+	update_projection(rect);
+	refresh_times.projection = elapsed_ms(start);
+
+	release_layers();
+
+	ID2D1DCRenderTarget *target = direct2d->target.get();
+	if (FAILED(target->BindDC(hdc, &rect))) return;
+
+	target->BeginDraw();
+	target->SetTransform(D2D1::Matrix3x2F::Translation(-rect.left, -rect.top));
+
+	Direct2DRenderer renderer(*direct2d);
+	for (std::string_view group : visible_groups())
+		draw_routes(renderer, rect, group);
+
+	// the render target is lost with its device, and is made again next time
+	if (target->EndDraw() == D2DERR_RECREATE_TARGET) direct2d.reset();
+}
+
+bool Screen::OnCompileCommand(const char *command) {
+	// every command comes here first, so only as much is read as is needed
+	// to tell whether it is for the screen
+	std::vector<std::string_view> parts = tokenize(command, 2);
+
+	if (parts.size() < 2 || parts[0] != COMMAND_PREFIX) return false;
+	if (parts[1] != "hide" && parts[1] != "show") return false;
+
+	parts = tokenize(command);
+
+	bool hide = parts[1] == "hide";
+	std::span<const std::string_view> names(parts.begin() + 2, parts.end());
+
+	if (hide && names.empty()) return false;
+
+	if (!hide && names.empty()) {
+		hidden.clear();
+	} else {
+		for (auto name : names)
+			if (hide) hidden.emplace(name);
+			else hidden.erase(std::string(name));
+	}
+
+	// the affected plots are projected again, or left empty if now hidden
+	for (auto &[name, proj] : projected) {
+		bool affected = names.empty() || std::any_of(names.begin(), names.end(), [&](auto n) {
+			return n == name || n == proj.group;
+		});
+		if (affected) proj.plot = nullptr;
+	}
+
+	projected_version = 0;
+	plugin->invalidate(*this);
+	plugin->flush();
+
+	return true;
+}
+
+const int LABEL_CELL_SIZE = 64;
+
+LabelGrid::LabelGrid(const RECT &_area) :
+	area(_area),
+	columns(std::max<LONG>((_area.right - _area.left) / LABEL_CELL_SIZE + 1, 1)),
+	rows(std::max<LONG>((_area.bottom - _area.top) / LABEL_CELL_SIZE + 1, 1)),
+	cells(columns * rows) {}
+
+bool LabelGrid::place(const Gdiplus::RectF &label) {
+	// labels reaching outside the view share the cells at its edges
+	auto column = [this](double x) {
+		return std::clamp((int) std::floor((x - area.left) / LABEL_CELL_SIZE), 0, columns - 1);
+	};
+	auto row = [this](double y) {
+		return std::clamp((int) std::floor((y - area.top) / LABEL_CELL_SIZE), 0, rows - 1);
+	};
+
+	int x0 = column(label.X), x1 = column(label.X + label.Width);
+	int y0 = row(label.Y), y1 = row(label.Y + label.Height);
+
+	for (int y = y0; y <= y1; y++)
+		for (int x = x0; x <= x1; x++)
+			for (const auto &other : cells[y * columns + x])
+				if (other.IntersectsWith(label)) return false;
+
+	for (int y = y0; y <= y1; y++)
+		for (int x = x0; x <= x1; x++)
+			cells[y * columns + x].push_back(label);
+
+	return true;
+}
+
+void Screen::draw_routes(Renderer &renderer, const RECT &rect, std::string_view group) {
+	using namespace Gdiplus;
+
+	// in banded mode, contiguous segments in the same band form one figure
+	int last_band = -1;
+	size_t last_node = 0;
+
+	POINT point1, point2;
+
+	// the plots are drawn in the order they were added, from the projections
+	for (const auto &[name, _] : plugin->routes) {
+		const ProjectedRoute &proj = projected.at(name);
+		if (proj.empty() || proj.group != group) continue;
+
+		size_t n = proj.plot->route.size() - 1;
+		Clock::time_point start = Clock::now();
+
+		for (const auto &hold : proj.holds) {
+			Color hold_colour = colour((double) hold.node / (double) n);
+
+			renderer.DrawArc({ hold.oc.x - hold.r, hold.oc.y - hold.r }, hold.d, hold.angle, -180, hold_colour);
+			renderer.DrawLine(hold.os, hold.oe, hold_colour);
+			renderer.DrawArc({ hold.ic.x - hold.r, hold.ic.y - hold.r }, hold.d, hold.angle, 180, hold_colour);
+			renderer.DrawLine(hold.is, hold.ie, hold_colour);
+		}
+
+		refresh_times.holds += elapsed_ms(start);
+		start = Clock::now();
+
+		for (const auto &[from, to, segment1, segment2] : proj.segments) {
+			point1 = segment1;
+			point2 = segment2;
+
+			if (plugin->smooth_gradients) {
+				renderer.DrawGradientLine(
+					point1, point2, colour((double) from / (double) n), colour((double) to / (double) n)
+				);
+			} else {
+				double t = ((double) from + (double) to) / 2.0 / (double) n;
+				int band = std::min((int) (t * COLOUR_BANDS), COLOUR_BANDS - 1);
+
+				renderer.AddBandLine(band, point1, point2, band != last_band || from != last_node);
+
+				last_band = band;
+				last_node = to;
+			}
+		}
+
+		last_band = -1;
+		refresh_times.lines += elapsed_ms(start);
+	}
+
+	Clock::time_point start = Clock::now();
+	if (!plugin->smooth_gradients) renderer.DrawBands();
+	refresh_times.lines += elapsed_ms(start);
+
+	// name labels, then nodes and their labels
+	start = Clock::now();
+
+	for (const auto &[name, _] : plugin->routes) {
+		const ProjectedRoute &proj = projected.at(name);
+		if (proj.empty() || proj.group != group) continue;
+
+		for (const auto &label : proj.labels)
+			renderer.DrawString(
+				proj.plot->name, PointF(label.x, label.y), -label.angle * DEG_PER_RAD, Renderer::TEXT_NAME
+			);
+	}
+
+	LabelGrid label_grid(rect);
+	RectF label_rect;
+
+	for (const auto &[name, _] : plugin->routes) {
+		const ProjectedRoute &proj = projected.at(name);
+		if (proj.empty() || proj.group != group) continue;
+
+		const Route &route = proj.plot->route;
+
+		for (const auto &[i, point] : proj.nodes) {
+			point1 = point;
+
+			int r = route.highlighted(i) ? 4 : 1;
+			renderer.DrawEllipse(point1, r, Color(0xff, 0xff, 0xff));
+
+			if (auto label = route.label(i)) {
+				PointF origin(point1.x + r + 4, point1.y - (FONT_SIZE / 2));
+
+				label_rect = renderer.MeasureString(*label);
+				label_rect.X += origin.X;
+				label_rect.Y += origin.Y;
+
+				if (label_grid.place(label_rect))
+					renderer.DrawString(*label, origin, 0.0, Renderer::TEXT_LABEL);
+			}
+		}
+	}
+
+	refresh_times.labels += elapsed_ms(start);
+}
+
+
+
+Plugin::Plugin(void) :
+	EuroScope::CPlugIn(
+		EuroScope::COMPATIBILITY_CODE,
+		PLUGIN_NAME, PLUGIN_VERSION, PLUGIN_AUTHORS, PLUGIN_LICENCE
+	)
+{
+	sources["coords"] = std::make_unique<CoordsSource>();
+	sources["route"] = std::make_unique<RouteSource>();
+	sources["binary"] = std::make_unique<BinarySource>();
+	sources["flight"] = std::make_unique<FlightPlanSource>();
+
+	if (const char *gradient = GetDataFromSettings("Gradient"))
+		smooth_gradients = !std::strcmp(gradient, "smooth");
+
+	if (const char *renderer = GetDataFromSettings("Renderer"))
+		direct2d = !std::strcmp(renderer, "direct2d");
+
+	// the sector file is read from OnTimer and OnRefresh, so as not to delay loading
+	reload_navdata();
+}
+
+// the group of plots not moved into another
+const std::string DEFAULT_GROUP = "default";
+
+// the number of failed lines to list after a load
+const size_t LOAD_ERRORS_SHOWN = 10;
+// the fewest lines worth giving to each thread parsing a load
+const size_t LOAD_LINES_PER_WORKER = 64;
+
+bool Plugin::OnCompileCommand(const char *command) {
+	std::string_view sv(command);
+	std::vector<std::string_view> parts = tokenize(sv);
+
+	if (parts.empty() || parts[0] != COMMAND_PREFIX) return false;
+
+	if (parts.size() == 1 || parts[1] == "help") {
+		size_t width = 23; // strlen("layer <GROUP> <NAME>...")
+		for (const auto &[name, source] : sources) {
+			size_t unique_size = name.size() + std::strlen(source->HelpArguments());
+			width = std::max(width, unique_size + 8 /* strlen(" [NAME] ") */);
+		}
+
+		display_message("", "Available commands:");
+		display_command("help", "Display this help text", width);
+		display_command("clear [NAME]...", "Remove the named plot, or all plots", width);
+		display_command("reload", "Reload navigation data from the sector file", width);
+		display_command("load <FILE>", "Add a plot for each line of a file", width);
+		display_command("layer <GROUP> <NAME>...", "Move the named plots into a group", width);
+		display_command("hide <NAME>...", "Hide the named plots or groups on this screen", width);
+		display_command("show [NAME]...", "Show the named plots or groups, or all, on this screen", width);
+		display_command("library <FILE>", "Open a library of routes in the binary format", width);
+		display_command("recall <NAME>...", "Plot the named routes from the open library", width);
+		display_command("validate", "Compare the fitted projection against EuroScope", width);
+		display_command("stats [trace [FILE]]", "Report timings, or trace them to a CSV file", width);
+		display_command("gradient <MODE>", "Draw \"banded\" (default) or \"smooth\" gradients", width);
+		display_command("renderer <NAME>", "Draw with \"gdiplus\" (default) or \"direct2d\"", width);
+
+		for (const auto &[name, source] : sources) {
+			display_command(
+				std::format("{} [NAME] {}", name, source->HelpArguments()).c_str(),
+				source->HelpDescription(),
+				width
+			);
+		}
+
+		display_command("[NAME] <ROUTE>", "Shortcut for \".plot route [NAME] <ROUTE>\"", width);
+		display_message("", "See <" PLUGIN_WEBSITE "> for more information.");
+
+		return true;
+	}
+
+	if (parts[1] == "clear") {
+		if (parts.size() > 2) {
+			for (auto it = parts.cbegin() + 2; it < parts.cend(); it++) {
+				auto plot = routes.find(*it);
+				if (plot == routes.end()) continue;
+
+				invalidate(plot->second->bounds);
+				live_plots.erase(plot->first);
+				plot_groups.erase(plot->first);
+				resolved_plots.erase(plot->first);
+				restored_plots.erase(plot->first);
+				routes.erase(plot);
+			}
+		} else {
+			routes.clear();
+			live_plots.clear();
+			plot_groups.clear();
+			resolved_plots.clear();
+			restored_plots.clear();
+			invalidate();
+		}
+
+		routes_version++;
+		flush();
+
+		return true;
+	}
+
+	if (parts[1] == "gradient") {
+		if (parts.size() != 3 || (parts[2] != "smooth" && parts[2] != "banded")) {
+			display_message("Error", "expected \"smooth\" or \"banded\"", true);
+			return false;
+		}
+
+		smooth_gradients = parts[2] == "smooth";
+		SaveDataToSettings("Gradient", "Gradient drawing mode", std::string(parts[2]).c_str());
+
+		invalidate();
+		flush();
+
+		return true;
+	}
+
+	if (parts[1] == "renderer") {
+		if (parts.size() != 3 || (parts[2] != "gdiplus" && parts[2] != "direct2d")) {
+			display_message("Error", "expected \"gdiplus\" or \"direct2d\"", true);
+			return false;
+		}
+
+		direct2d = parts[2] == "direct2d";
+		SaveDataToSettings("Renderer", "Drawing backend", std::string(parts[2]).c_str());
+
+		// screens where Direct2D failed are given another chance
+		for (auto screen : screens)
+			if (screen) screen->direct2d_failed = false;
+
+		invalidate();
+		flush();
+
+		return true;
+	}
+
+	if (parts[1] == "validate") {
+		for (size_t i = 0; i < screens.size(); i++)
+			if (screens[i])
+				display_message(
+					"", std::format("Screen {}: {}", i + 1, screens[i]->validate_projection()).c_str()
+				);
+
+		return true;
+	}
+
+	if (parts[1] == "stats") {
+		if (parts.size() == 2) {
+			display_stats();
+			return true;
+		}
+
+		if (parts[2] != "trace") {
+			display_message("Error", "expected \"trace\"", true);
+			return false;
+		}
+
+		trace.close();
+
+		if (parts.size() == 3) {
+			display_message("", "Stopped tracing.");
+			return true;
+		}
+
+		std::string path(parts[3].data(), parts.back().data() + parts.back().size());
+
+		trace.open(path, std::ios::trunc);
+		if (!trace) {
+			trace.close();
+			display_message("Error", std::format("could not open \"{}\"", path).c_str(), true);
+			return false;
+		}
+
+		trace_start = Clock::now();
+		trace << "time_ms,event,subject,phase,ms\n";
+		display_message("", std::format("Tracing to \"{}\".", path).c_str());
+
+		return true;
+	}
+
+	if (parts[1] == "reload") {
+		reload_navdata();
+		display_message("", "Reloading navigation data.");
+
+		return true;
+	}
+
+	if (parts[1] == "layer") {
+		if (parts.size() < 4) {
+			display_message("Error", "expected a group and plot names", true);
+			return false;
+		}
+
+		std::string group(parts[2]);
+
+		for (auto it = parts.cbegin() + 3; it < parts.cend(); it++) {
+			auto plot = routes.find(*it);
+			if (plot == routes.end()) continue;
+
+			if (group == DEFAULT_GROUP) plot_groups.erase(plot->first);
+			else plot_groups[plot->first] = group;
+
+			// screens see the change of group, and move the plot between layers
+			invalidate(plot->second->bounds);
+		}
+
+		routes_version++;
+		flush();
+
+		return true;
+	}
+
+	// the active screen handles these, so they only get here if it's not one
+	// of the plugin's, or there is nothing to hide
+	if (parts[1] == "hide" || parts[1] == "show") {
+		if (parts[1] == "hide" && parts.size() < 3) display_message("Error", "expected names", true);
+		else display_message("Error", "no radar screen of this plugin is active", true);
+
+		return false;
+	}
+
+	if (parts[1] == "library") {
+		if (parts.size() < 3) {
+			display_message("Error", "expected a file name", true);
+			return false;
+		}
+
+		std::string path(parts[2].data(), parts.back().data() + parts.back().size()), error;
+		auto opened = std::make_unique<Library>();
+
+		if (!opened->open(path, error)) {
+			display_message("Error", std::format("{}: {}", path, error).c_str(), true);
+			return false;
+		}
+
+		library = std::move(opened);
+		display_message("", std::format("Opened {} routes from \"{}\".", library->size(), path).c_str());
+
+		return true;
+	}
+
+	if (parts[1] == "recall") {
+		if (!library) {
+			display_message("Error", "no library is open", true);
+			return false;
+		}
+
+		bool ok = true;
+
+		for (auto it = parts.cbegin() + 2; it < parts.cend(); it++) {
+			Route route;
+			std::string error;
+
+			if (!library->load(*it, route, error)) {
+				display_message("Error", std::format("{}: {}", *it, error).c_str(), true);
+				ok = false;
+			} else if (route.size() > 0) {
+				std::string name(*it);
+
+				Clock::time_point start = Clock::now();
+				Plot built(name, std::move(route));
+				record_build(elapsed_ms(start));
+
+				store_plot(name, std::move(built));
+			}
+		}
+
+		routes_version++;
+		flush();
+
+		return ok;
+	}
+
+	if (parts[1] == "load") {
+		if (parts.size() < 3) {
+			display_message("Error", "expected a file name", true);
+			return false;
+		}
+
+		if (!navdata_cache) {
+			pending_commands.push_back(command);
+			display_message("", std::format(
+				"Navigation data is still loading ({}); the plots will be added shortly.", navdata_progress()
+			).c_str());
+
+			return true;
+		}
+
+		std::string path(parts[2].data(), parts.back().data() + parts.back().size());
+
+		std::ifstream file(path);
+		if (!file) {
+			display_message("Error", std::format("could not open \"{}\"", path).c_str(), true);
+			return false;
+		}
+
+		struct Line {
+			size_t number;
+			std::string text, name, error;
+			PlotCommand command;
+			std::optional<Plot> plot;
+			bool parsed = false;
+			double parse_ms = 0.0, build_ms = 0.0;
+		};
+
+		std::vector<Line> lines;
+		std::string text;
+
+		for (size_t number = 1; std::getline(file, text); number++) {
+			if (!text.empty() && text.back() == '\r') text.pop_back();
+
+			size_t start = text.find_first_not_of(" \t");
+			if (start == std::string::npos || text[start] == '#') continue;
+
+			// names are given in file order, so that they don't depend on scheduling
+			lines.push_back({ number, text.substr(start), std::to_string(++name_counter) });
+		}
+
+		for (auto &line : lines) line.command = split_plot(line.text);
+
+		auto parse_line = [this](Line &line) {
+			Route route;
+
+			// a line that fails in any way is reported with the others, rather
+			// than an exception escaping a worker into EuroScope
+			Clock::time_point start = Clock::now();
+			try {
+				line.parsed = parse_plot(line.command, line.name, route, line.error);
+			} catch (const std::exception &e) {
+				line.parsed = false;
+				line.error = e.what();
+			}
+			line.parse_ms = elapsed_ms(start);
+
+			start = Clock::now();
+			if (line.parsed && route.size() > 0) line.plot.emplace(line.name, std::move(route));
+			line.build_ms = elapsed_ms(start);
+		};
+
+		// live plots query EuroScope, so are left for this thread
+		auto parse = [&lines, &parse_line](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++)
+				if (!lines[i].command.source->Live()) parse_line(lines[i]);
+		};
+
+		size_t workers = std::clamp<size_t>(
+			lines.size() / LOAD_LINES_PER_WORKER, 1, std::max(std::thread::hardware_concurrency(), 1u)
+		);
+		std::vector<std::future<void>> chunks;
+
+		for (size_t k = 1; k < workers; k++)
+			chunks.push_back(std::async(
+				std::launch::async, parse, lines.size() * k / workers, lines.size() * (k + 1) / workers
+			));
+
+		parse(0, lines.size() / workers);
+		for (auto &chunk : chunks) chunk.get();
+
+		for (auto &line : lines)
+			if (line.command.source->Live()) parse_line(line);
+
+		std::vector<std::string> errors;
+		size_t added = 0;
+
+		for (auto &line : lines) {
+			record_parse(line.command.source, line.parse_ms);
+			if (line.plot) record_build(line.build_ms);
+
+			if (!line.parsed) {
+				errors.push_back(std::format("line {}: {}", line.number, line.error));
+				continue;
+			}
+
+			if (line.plot) {
+				store_plot(line.name, std::move(*line.plot));
+				if (line.command.source->RequiresNavdata())
+					resolved_plots[line.name] = { line.text, navdata_cache->version };
+			}
+			if (line.command.source->Live())
+				live_plots[line.name] = { to_upper(line.command.args.back()), line.text };
+			added++;
+		}
+
+		routes_version++;
+		flush();
+
+		display_message("", std::format(
+			"Added {} of {} plots from \"{}\".", added, added + errors.size(), path
+		).c_str(), !errors.empty());
+
+		for (size_t i = 0; i < errors.size() && i < LOAD_ERRORS_SHOWN; i++)
+			display_message("Error", errors[i].c_str());
+
+		if (errors.size() > LOAD_ERRORS_SHOWN)
+			display_message("Error", std::format("and {} more", errors.size() - LOAD_ERRORS_SHOWN).c_str());
+
+		return errors.empty();
+	}
+
+	PlotCommand plot = split_plot(sv.substr(parts[1].data() - command), std::span(parts).subspan(1));
+
+	if (plot.source->RequiresNavdata() && !navdata_cache) {
+		pending_commands.push_back(command);
+		display_message("", std::format(
+			"Navigation data is still loading ({}); the plot will be added shortly.", navdata_progress()
+		).c_str());
+
+		return true;
+	}
+
+	std::string error;
+
+	if (add_plot(plot, error)) {
+		routes_version++;
+		flush();
+
+		return true;
+	} else {
+		display_message("Error", error.c_str(), true);
+		return false;
+	}
+}
+
+bool Plugin::add_plot(const PlotCommand &plot, std::string &error) {
+	std::string name = std::to_string(++name_counter);
+	Route route;
+
+	Clock::time_point start = Clock::now();
+	bool parsed = parse_plot(plot, name, route, error);
+	record_parse(plot.source, elapsed_ms(start));
+
+	if (!parsed) return false;
+
+	if (route.size() > 0) {
+		start = Clock::now();
+		Plot built(name, std::move(route));
+		record_build(elapsed_ms(start));
+
+		store_plot(name, std::move(built));
+		if (plot.source->RequiresNavdata())
+			resolved_plots[name] = { std::string(plot.text), navdata_cache->version };
+	}
+
+	if (plot.source->Live()) live_plots[name] = { to_upper(plot.args.back()), std::string(plot.text) };
+
+	return true;
+}
+
+PlotCommand Plugin::split_plot(std::string_view command) const {
+	return split_plot(command, tokenize(command));
+}
+
+PlotCommand Plugin::split_plot(std::string_view command, std::span<const std::string_view> tokens) const {
+	PlotCommand plot;
+	plot.text = command;
+
+	auto source = tokens.empty() ? sources.cend() : sources.find(tokens.front());
+
+	if (source == sources.cend()) {
+		source = sources.find("route");
+	} else {
+		tokens = tokens.subspan(1);
+	}
+
+	plot.args.assign(tokens.begin(), tokens.end());
+
+	plot.source = source->second.get();
+	if (!plot.args.empty()) plot.src = command.substr(plot.args.front().data() - command.data());
+
+	return plot;
+}
+
+bool Plugin::parse_plot(const PlotCommand &plot, std::string &name, Route &route, std::string &error) const {
+	if (plot.args.empty()) {
+		error = std::string("expected a route");
+		return false;
+	}
+
+	return plot.source->Parse(plot.args, plot.src, route, name, error);
+}
+
+void Plugin::store_plot(const std::string &name, Plot &&plot) {
+	auto old = routes.find(name);
+	if (old != routes.end()) invalidate(old->second->bounds);
+	invalidate(plot.bounds);
+
+	routes.insert_or_assign(name, std::make_shared<const Plot>(std::move(plot)));
+	live_plots.erase(name);
+	resolved_plots.erase(name);
+	restored_plots.erase(name);
+}
+
+void Plugin::invalidate(const Bounds &bounds) {
+	dirty_screens.resize(screens.size());
+
+	for (size_t i = 0; i < screens.size(); i++)
+		if (screens[i] && screens[i]->shows(bounds)) dirty_screens[i] = true;
+}
+
+void Plugin::invalidate(const Screen &screen) {
+	dirty_screens.resize(screens.size());
+	dirty_screens[screen.i] = true;
+}
+
+void Plugin::invalidate() {
+	dirty_screens.assign(screens.size(), true);
+}
+
+void Plugin::flush() {
+	// later changes wait for the next tick, so a burst of commands is drawn once
+	if (refreshed_this_tick) return;
+
+	for (size_t i = 0; i < dirty_screens.size(); i++) {
+		if (dirty_screens[i] && screens[i]) {
+			screens[i]->RefreshMapContent();
+			refreshed_this_tick = true;
+		}
+
+		dirty_screens[i] = false;
+	}
+}
+
+void Plugin::OnFlightPlanFlightPlanDataUpdate(EuroScope::CFlightPlan flight_plan) {
+	std::string callsign = to_upper(flight_plan.GetCallsign());
+
+	std::vector<std::pair<std::string, LivePlot>> following;
+	for (const auto &entry : live_plots)
+		if (entry.second.callsign == callsign) following.push_back(entry);
+
+	// only the plots following this flight plan are parsed again
+	for (auto &[name, live] : following) {
+		PlotCommand plot = split_plot(live.command);
+		std::string plot_name = name, error;
+		Route route;
+
+		Clock::time_point start = Clock::now();
+		bool parsed = parse_plot(plot, plot_name, route, error);
+		record_parse(plot.source, elapsed_ms(start));
+
+		if (!parsed || route.size() == 0) continue;
+
+		start = Clock::now();
+		Plot built(name, std::move(route));
+		record_build(elapsed_ms(start));
+
+		store_plot(name, std::move(built));
+		live_plots[name] = std::move(live);
+		routes_version++;
+	}
+
+	flush();
+}
+
+void Plugin::OnFlightPlanDisconnect(EuroScope::CFlightPlan flight_plan) {
+	std::string callsign = to_upper(flight_plan.GetCallsign());
+
+	for (auto it = live_plots.begin(); it != live_plots.end();) {
+		if (it->second.callsign != callsign) {
+			it++;
+			continue;
+		}
+
+		auto plot = routes.find(it->first);
+		if (plot != routes.end()) {
+			invalidate(plot->second->bounds);
+			routes.erase(plot);
+			routes_version++;
+		}
+
+		it = live_plots.erase(it);
+	}
+
+	flush();
+}
+
+Screen *Plugin::OnRadarScreenCreated(const char *, bool, bool, bool geo, bool) {
+	if (!geo) return nullptr;
+
+	auto *screen = new Screen(screens.size());
+	screens.push_back(screen);
+
+	return screen;
+}
+
+void Plugin::OnAirportRunwayActivityChanged() {
+	// also called when the sector file is reloaded
+	reload_navdata();
+}
+
+void Plugin::OnTimer(int) {
+	update_navdata();
+
+	refreshed_this_tick = false;
+	flush();
+}
+
+const Navdata *Plugin::navdata() const {
+	return navdata_cache.get();
+}
+
+const std::string &Plugin::group_of(const std::string &name) const {
+	auto group = plot_groups.find(name);
+	return group != plot_groups.end() ? group->second : DEFAULT_GROUP;
+}
+
+// each chunk of the snapshot is kept short enough not to be noticed, and
+// chunks are taken on every refresh as well as every tick
+const auto NAVDATA_SNAPSHOT_BUDGET = std::chrono::milliseconds(20);
+
+void Plugin::reload_navdata() {
+	navdata_snapshot.clear();
+	navdata_cursor = EuroScope::CSectorElement();
+	navdata_loading = true;
+	navdata_scanning_ms = 0.0;
+
+	// an index being built from the previous snapshot is discarded
+	if (navdata_future.valid()) navdata_stale = true;
+}
+
+void Plugin::update_navdata() {
+	// a finished build replaces the index, and the commands waiting on it run
+	if (navdata_future.valid()) {
+		if (navdata_future.wait_for(std::chrono::seconds(0)) != std::future_status::ready) return;
+
+		auto result = navdata_future.get();
+		if (navdata_stale) {
+			navdata_stale = false;
+		} else {
+			navdata_cache = std::move(result);
+			resolve_restored();
+
+			auto commands = std::move(pending_commands);
+			pending_commands.clear();
+
+			if (!commands.empty())
+				display_message("", std::format(
+					"Navigation data loaded; running {} waiting command{}.",
+					commands.size(), commands.size() == 1 ? "" : "s"
+				).c_str());
+
+			for (const auto &command : commands) OnCompileCommand(command.c_str());
+		}
+	}
+
+	scan_navdata();
+}
+
+// copies the parts of the element Navdata uses, or returns false if it uses
+// none of its type
+static bool copy_sector_element(EuroScope::CSectorElement &element, SectorElement &el) {
+	using namespace EuroScope;
+
+	CPosition pos;
+	el.type = element.GetElementType();
+
+	switch (el.type) {
+		case SECTOR_ELEMENT_AIRPORT:
+		case SECTOR_ELEMENT_VOR:
+		case SECTOR_ELEMENT_NDB:
+		case SECTOR_ELEMENT_FIX:
+		case SECTOR_ELEMENT_LOW_AIRWAY:
+		case SECTOR_ELEMENT_HIGH_AIRWAY:
+			el.name = element.GetName();
+			break;
+
+		case SECTOR_ELEMENT_RUNWAY:
+			el.airport = element.GetAirportName();
+			el.runways[0] = element.GetRunwayName(0);
+			el.runways[1] = element.GetRunwayName(1);
+			break;
+
+		case SECTOR_ELEMENT_SIDS_STARS:
+			el.name = element.GetName();
+			el.airport = element.GetAirportName();
+			el.runways[0] = element.GetRunwayName(0);
+			break;
+
+		default:
+			return false;
+	}
+
+	if (el.type == SECTOR_ELEMENT_RUNWAY) {
+		// runway ends are positional, so missing ends are kept as NaN
+		for (int j = 0; j <= 1; j++)
+			el.positions.push_back(
+				element.GetPosition(&pos, j)
+					? Position { pos.m_Latitude, pos.m_Longitude }
+					: Position { NAN, NAN }
+			);
+	} else {
+		for (int j = 0; element.GetPosition(&pos, j); j++)
+			el.positions.push_back({ pos.m_Latitude, pos.m_Longitude });
+	}
+
+	return true;
+}
+
+void Plugin::scan_navdata() {
+	using namespace EuroScope;
+
+	// snapshotting resumes only once any build in progress has been collected
+	if (!navdata_loading || navdata_future.valid()) return;
+
+	// EuroScope is not thread-safe, so the sector file is copied in chunks on
+	// the main thread, and only indexed on the worker
+	Clock::time_point start = Clock::now();
+	auto deadline = start + NAVDATA_SNAPSHOT_BUDGET;
+
+	for (
+		navdata_cursor = navdata_cursor.IsValid()
+			? SectorFileElementSelectNext(navdata_cursor, SECTOR_ELEMENT_ALL)
+			: SectorFileElementSelectFirst(SECTOR_ELEMENT_ALL);
+		navdata_cursor.IsValid();
+		navdata_cursor = SectorFileElementSelectNext(navdata_cursor, SECTOR_ELEMENT_ALL)
+	) {
+		SectorElement el;
+		if (copy_sector_element(navdata_cursor, el)) navdata_snapshot.push_back(std::move(el));
+
+		// most elements of a large sector file are of types not kept, so the
+		// deadline is checked for every element visited
+		if (Clock::now() >= deadline) {
+			navdata_scanning_ms += elapsed_ms(start);
+
+			// while commands wait on it, screens are refreshed to take
+			// the next chunk sooner than the next tick
+			if (!pending_commands.empty())
+				for (Screen *screen : screens)
+					if (screen) {
+						screen->RefreshMapContent();
+						break;
+					}
+
+			return;
+		}
+	}
+
+	navdata_scanning_ms += elapsed_ms(start);
+	navdata_scans++;
+	navdata_elements = navdata_snapshot.size();
+	navdata_scan_ms = navdata_scanning_ms;
+	if (trace.is_open()) record_trace("scan", "sector", "total", navdata_scan_ms);
+
+	navdata_loading = false;
+	navdata_future = std::async(
+		std::launch::async,
+		[snapshot = std::move(navdata_snapshot)]() -> std::shared_ptr<const Navdata> {
+			return std::make_shared<Navdata>(snapshot);
+		}
+	);
+	navdata_snapshot.clear();
+}
+
+std::string Plugin::navdata_progress() const {
+	if (navdata_loading) return std::format("{} sector file elements read", navdata_snapshot.size());
+	return std::format("indexing {} sector file elements", navdata_elements);
+}
+
+// includes resolving the route against the navigation data
+void Plugin::record_parse(const Source *source, double ms) {
+	std::string_view name;
+	for (const auto &[key, value] : sources)
+		if (value.get() == source) name = key;
+
+	auto samples = parse_samples.find(name);
+	if (samples == parse_samples.end()) samples = parse_samples.emplace(name, Samples()).first;
+	samples->second.add(ms);
+
+	if (trace.is_open()) record_trace("parse", name, "total", ms);
+}
+
+void Plugin::record_build(double ms) {
+	build_samples.add(ms);
+	if (trace.is_open()) record_trace("build", "plot", "total", ms);
+}
+
+void Plugin::record_trace(const char *event, std::string_view subject, const char *phase, double ms) {
+	trace << std::format("{:.3f},{},{},{},{:.3f}\n", elapsed_ms(trace_start), event, subject, phase, ms);
+}
+
+void Plugin::display_stats() {
+	auto timings = [](const Samples &samples) {
+		return std::format("{:.2f}/{:.2f}", samples.percentile(50.0), samples.percentile(99.0));
+	};
+
+	display_message("", "Timings are p50/p99 in ms, over the latest samples.");
+
+	for (size_t i = 0; i < screens.size(); i++) {
+		const Screen *screen = screens[i];
+		if (!screen) continue;
+
+		size_t bytes = 0;
+		for (const auto &[name, proj] : screen->projected) bytes += name.capacity() + proj.memory();
+
+		display_message("", std::format(
+			"Screen {}: {} refreshes, {} (projection {}, lines {}, holds {}, labels {}), about {} KiB projected",
+			i + 1, screen->refresh_samples.count(), timings(screen->refresh_samples),
+			timings(screen->projection_samples), timings(screen->lines_samples),
+			timings(screen->holds_samples), timings(screen->labels_samples), (bytes + 1023) / 1024
+		).c_str());
+	}
+
+	for (const auto &[name, samples] : parse_samples)
+		display_message("", std::format(
+			"Source {}: {} parses, {}", name, samples.count(), timings(samples)
+		).c_str());
+
+	display_message("", std::format(
+		"Building plots: {} plots, {}", build_samples.count(), timings(build_samples)
+	).c_str());
+
+	size_t nodes = 0, bytes = 0;
+	for (const auto &[name, plot] : routes) {
+		nodes += plot->route.size();
+		bytes += name.capacity() + plot->memory();
+	}
+
+	display_message("", std::format(
+		"Plots: {} plots, {} nodes, about {} KiB", routes.size(), nodes, (bytes + 1023) / 1024
+	).c_str());
+
+	display_message("", std::format(
+		"Sector file: {} scans, {} elements and {:.1f} ms in the last{}",
+		navdata_scans, navdata_elements, navdata_scan_ms, navdata_loading ? ", one in progress" : ""
+	).c_str());
+}
+
+void Plugin::display_message(const char *from, const char *msg, bool urgent) {
+	DisplayUserMessage(PLUGIN_NAME, from, msg, true, true, urgent, urgent, false);
+}
+
+void Plugin::display_command(const char *command, const char *help, size_t width) {
+	display_message(
+		"",
+		std::format("  " COMMAND_PREFIX " {:<{}} - {}", command, width, help).c_str()
+	);
+}
+
+
+
+// the value of each character of the legacy format, or -1 if it is not one
+static constexpr auto DECODE_TABLE = [] {
+	std::array<signed char, 256> table;
+	table.fill(-1);
+
+	for (int c = 0; c < 26; c++) {
+		table['A' + c] = c;
+		table['a' + c] = 26 + c;
+	}
+	for (int c = 0; c < 10; c++) table['0' + c] = 52 + c;
+
+	return table;
+}();
+
+static signed char decode(char c) {
+	return DECODE_TABLE[(unsigned char) c];
+}
+
+bool CoordsSource::Parse(
+	std::span<const std::string_view> args,
+	std::string_view command,
+	Route &route,
+	std::string &name,
+	std::string &error
+) const {
+	if (args.empty() || command.empty()) {
+		error = std::string("missing string");
+		return false;
+	}
+
+	if (args.size() > 1 && args[0].find('(') == std::string_view::npos) {
+		name = args[0];
+		command = command.substr(args[1].data() - command.data());
+	}
+
+	Node item;
+	signed char word[7];
+
+	// each node takes at least seven characters
+	route.reserve(command.size() / 7);
+
+	size_t i = command[0] == '@' ? 0 : -1;
+	// reads as NUL past the end, which decodes as an invalid character
+	auto next = [&]() { return ++i < command.size() ? command[i] : '\0'; };
+
+	while (next()) {
+		// a label with no node to attach to, as after a leading
+		// discontinuity, is read and ignored
+		if (command[i] == '(') {
+			int count = 1;
+			size_t start = i + 1, end = i;
+
+			while (count) {
+				end = command.find_first_of("()", end + 1);
+				if (end == std::string_view::npos) {
+					error = std::string("missing closing bracket");
+					return false;
+				}
+				if (command[end] == '(') count++;
+				else count--;
+			}
+
+			i = end;
+			route.label_last(strings.intern(command.substr(start, end - start)));
+
+			continue;
+		} else if (command[i] == '-') {
+			item.lat = NAN;
+			item.highlight = false;
+		} else if ((word[0] = decode(command[i])) >= 0) {
+			// invalid characters decode as -1, so one check covers the whole word
+			signed char invalid = 0;
+			for (int k = 1; k < 7; k++) invalid |= (word[k] = decode(next()));
+
+			if (invalid < 0) {
+				error = std::string("invalid character");
+				return false;
+			}
+
+			item.lat = word[1] + ((double) word[2] + (double) word[3] / 60) / 60;
+			item.lon = word[4] + ((double) word[5] + (double) word[6] / 60) / 60;
+
+			item.lat += 60.0 * ((word[0] >> 2) & 0b01);
+			item.lon += 60.0 * ((word[0] >> 4) & 0b11);
+
+			if (word[0] & 0b0010) item.lat = -item.lat;
+			if (word[0] & 0b1000) item.lon = -item.lon;
+
+			item.highlight = false;
+			item.hold = std::nullopt;
+
+			if (word[0] & 1) {
+				signed char extra1 = decode(next());
+				if (extra1 < 0) {
+					error = std::string("invalid character");
+					return false;
+				}
+
+				if (extra1 >= 60) {
+					item.highlight = true;
+				} else {
+					signed char extra2 = decode(next());
+					if (extra2 < 0) {
+						error = std::string("invalid character");
+						return false;
+					}
+
+					item.hold = Hold(
+						item.lat, item.lon,
+						(double) (extra2 & 0b1111),
+						6.0 * (double) extra1 + ((extra2 >> 5) ? 3.0 : 0.0),
+						((extra2 >> 4) & 1) == 1
+					);
+				}
+			}
+		} else {
+			error = std::string("invalid structural character");
+			return false;
+		}
+
+		item.label = std::nullopt;
+		route.push_back(item);
+	}
+
+	return true;
+}
+
+
+
+// the value of each base64 character, or -1 if it is not one
+static constexpr auto BASE64_TABLE = [] {
+	std::array<signed char, 256> table;
+	table.fill(-1);
+
+	for (int c = 0; c < 26; c++) {
+		table['A' + c] = c;
+		table['a' + c] = 26 + c;
+	}
+	for (int c = 0; c < 10; c++) table['0' + c] = 52 + c;
+	table['+'] = 62;
+	table['/'] = 63;
+
+	return table;
+}();
+
+static bool decode_base64(std::string_view str, std::vector<uint8_t> &out) {
+	while (!str.empty() && str.back() == '=') str.remove_suffix(1);
+	if (str.size() % 4 == 1) return false;
+
+	out.clear();
+	out.reserve(str.size() * 3 / 4);
+
+	uint32_t bits = 0;
+	int count = 0;
+
+	for (char c : str) {
+		signed char value = BASE64_TABLE[(unsigned char) c];
+		if (value < 0) return false;
+
+		bits = (bits << 6) | value;
+		count += 6;
+
+		if (count >= 8) {
+			count -= 8;
+			out.push_back((uint8_t) (bits >> count));
+		}
+	}
+
+	return true;
+}
+
+// reads little-endian fields from the decoded data, failing once it runs out
+struct BinaryReader {
+	const uint8_t *data, *end;
+
+	template<typename T>
+	bool read(T &value) {
+		if ((size_t) (end - data) < sizeof(T)) return false;
+
+		std::memcpy(&value, data, sizeof(T));
+		data += sizeof(T);
+
+		return true;
+	}
+
+	template<typename T>
+	bool read_array(std::vector<T> &values, uint32_t n) {
+		if ((size_t) (end - data) / sizeof(T) < n) return false;
+
+		values.resize(n);
+		std::memcpy(values.data(), data, n * sizeof(T));
+		data += n * sizeof(T);
+
+		return true;
+	}
+};
+
+const uint8_t BINARY_VERSION = 1;
+// coordinates are stored in units of 1e-7 degrees
+const double BINARY_COORD_SCALE = 1e-7;
+
+// version 1, all fields little-endian:
+//   u8 version; u32 nodes, breaks, highlights, labels, holds;
+//   i32 lat[nodes]; i32 lon[nodes];
+//   u32 breaks[breaks]; u32 highlights[highlights];
+//   labels: { u32 node; u16 length; char text[length]; }
+//   holds: { u32 node; u16 course, in 0.1 degrees; u8 length, in nmi; u8 flags, bit 0 for left turns; }
+// node indices in each list are strictly ascending, and breaks are never node 0
+static bool decode_binary(std::span<const uint8_t> bytes, Route &route, std::string &error) {
+	BinaryReader reader = { bytes.data(), bytes.data() + bytes.size() };
+	uint8_t version;
+	uint32_t nodes, breaks, highlights, labels, holds;
+
+	if (!reader.read(version) || version != BINARY_VERSION) {
+		error = std::string("unsupported binary version");
+		return false;
+	}
+
+	if (
+		!reader.read(nodes) || !reader.read(breaks) || !reader.read(highlights) ||
+		!reader.read(labels) || !reader.read(holds)
+	) goto truncated;
+
+	{
+		std::vector<int32_t> lat, lon;
+		if (!reader.read_array(lat, nodes) || !reader.read_array(lon, nodes)) goto truncated;
+
+		route.lat.resize(nodes);
+		route.lon.resize(nodes);
+		for (uint32_t i = 0; i < nodes; i++) {
+			route.lat[i] = (float) (lat[i] * BINARY_COORD_SCALE);
+			route.lon[i] = (float) (lon[i] * BINARY_COORD_SCALE);
+		}
+	}
+
+	if (!reader.read_array(route.breaks, breaks) || !reader.read_array(route.highlights, highlights))
+		goto truncated;
+
+	route.labels.reserve(labels);
+	for (uint32_t i = 0; i < labels; i++) {
+		uint32_t node;
+		uint16_t length;
+		if (!reader.read(node) || !reader.read(length) || (size_t) (reader.end - reader.data) < length)
+			goto truncated;
+
+		route.labels.emplace_back(node, strings.intern(std::string_view((const char *) reader.data, length)));
+		reader.data += length;
+	}
+
+	route.holds.reserve(holds);
+	for (uint32_t i = 0; i < holds; i++) {
+		uint32_t node;
+		uint16_t course;
+		uint8_t length, flags;
+		if (!reader.read(node) || !reader.read(course) || !reader.read(length) || !reader.read(flags))
+			goto truncated;
+
+		if (node >= nodes) goto invalid;
+		route.holds.emplace_back(node, Hold(
+			route.lat[node], route.lon[node], (double) length, course / 10.0, flags & 1
+		));
+	}
+
+	{
+		auto ascending = [nodes](const auto &list, auto node_of) {
+			for (size_t i = 0; i < list.size(); i++)
+				if (node_of(list[i]) >= nodes || (i > 0 && node_of(list[i]) <= node_of(list[i - 1])))
+					return false;
+			return true;
+		};
+		auto index = [](uint32_t node) { return node; };
+		auto first = [](const auto &pair) { return pair.first; };
+
+		if (
+			!ascending(route.breaks, index) || (!route.breaks.empty() && route.breaks.front() == 0) ||
+			!ascending(route.highlights, index) || !ascending(route.labels, first) ||
+			!ascending(route.holds, first)
+		) goto invalid;
+	}
+
+	return true;
+
+truncated:
+	error = std::string("truncated binary data");
+	return false;
+
+invalid:
+	error = std::string("node index out of order or range");
+	return false;
+}
+
+// in the same format, for saving resolved routes; holds are rounded to the
+// precision of the format, and labels narrowed to bytes
+static std::vector<uint8_t> encode_binary(const Route &route) {
+	std::vector<uint8_t> out;
+	auto write = [&out](auto value) {
+		const uint8_t *bytes = (const uint8_t *) &value;
+		out.insert(out.end(), bytes, bytes + sizeof(value));
+	};
+
+	write(BINARY_VERSION);
+	write((uint32_t) route.size());
+	write((uint32_t) route.breaks.size());
+	write((uint32_t) route.highlights.size());
+	write((uint32_t) route.labels.size());
+	write((uint32_t) route.holds.size());
+
+	for (float lat : route.lat) write((int32_t) std::lround(lat / BINARY_COORD_SCALE));
+	for (float lon : route.lon) write((int32_t) std::lround(lon / BINARY_COORD_SCALE));
+	for (uint32_t node : route.breaks) write(node);
+	for (uint32_t node : route.highlights) write(node);
+
+	for (const auto &[node, label] : route.labels) {
+		const std::wstring &text = strings[label];
+		size_t length = std::min<size_t>(text.size(), UINT16_MAX);
+
+		write(node);
+		write((uint16_t) length);
+		for (size_t i = 0; i < length; i++) out.push_back((uint8_t) text[i]);
+	}
+
+	for (const auto &[node, hold] : route.holds) {
+		write(node);
+		write((uint16_t) (std::lround(std::fmod(std::fmod(hold.course, 360.0) + 360.0, 360.0) * 10.0) % 3600));
+		write((uint8_t) std::clamp<long>(std::lround(hold.length), 0, UINT8_MAX));
+		write((uint8_t) hold.left_turns);
+	}
 
-	if (phase != EuroScope::REFRESH_PHASE_BACK_BITMAP) return;
+	return out;
+}
 
-	Graphics *ctx = Graphics::FromHDC(hdc);
+static std::string encode_base64(std::span<const uint8_t> bytes) {
+	static const char ALPHABET[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
-	FontFamily font_family(L"EuroScope");
-	Font font(&font_family, FONT_SIZE, FontStyleRegular, UnitPixel);
+	std::string out;
+	out.reserve((bytes.size() + 2) / 3 * 4);
 
-	RECT rect = GetRadarArea();
-	Rect clip(rect.left, rect.top, rect.right - rect.left, rect.bottom - rect.top);
-	ctx->SetClip(clip);
+	uint32_t bits = 0;
+	int count = 0;
 
-	Pen pen(colour(0.0), STROKE_WIDTH), brush_pen(colour(0.0), STROKE_WIDTH);
+	for (uint8_t byte : bytes) {
+		bits = (bits << 8) | byte;
+		count += 8;
 
-	EuroScope::CPosition position1, position2;
-	POINT point1, point2;
+		while (count >= 6) {
+			count -= 6;
+			out.push_back(ALPHABET[(bits >> count) & 63]);
+		}
+	}
 
-	struct Label {
-		std::wstring content;
-		double x, y, angle;
-	};
+	if (count > 0) out.push_back(ALPHABET[(bits << (6 - count)) & 63]);
+	while (out.size() % 4) out.push_back('=');
 
-	double dist = 0.0, inter = LABEL_INTERVAL * (double) (rect.bottom - rect.top);
-	std::vector<Label> labels;
+	return out;
+}
 
-	for (const auto &[name, route] : plugin->routes) {
-		size_t n = route.size() - 1;
-		for (size_t i = 0; i <= n; i++) {
-			if (route[i].IsDiscontinuity()) continue;
+bool BinarySource::Parse(
+	std::span<const std::string_view> args,
+	std::string_view,
+	Route &route,
+	std::string &name,
+	std::string &error
+) const {
+	if (args.empty() || args.size() > 2) {
+		error = std::string("expected a name and base64 data");
+		return false;
+	}
 
-			position1 = std::move(position2);
-			point1 = std::move(point2);
+	if (args.size() == 2) name = args[0];
 
-			position2.m_Latitude = route[i].lat;
-			position2.m_Longitude = route[i].lon;
+	std::vector<uint8_t> bytes;
+	if (!decode_base64(args.back(), bytes)) {
+		error = std::string("invalid base64");
+		return false;
+	}
 
-			point2 = ConvertCoordFromPositionToPixel(position2);
+	return decode_binary(bytes, route, error);
+}
 
-			if (auto hold = route[i].hold) {
-				// approximation
-				double crs_rad = hold->course / DEG_PER_RAD;
-				double lat_rad = route[i].lat / DEG_PER_RAD;
-				double len_deg = hold->length / DEG_LAT_PER_NM;
-				position2.m_Latitude -= len_deg * std::cos(crs_rad);
-				position2.m_Longitude -= len_deg * std::sin(crs_rad) / std::cos(lat_rad);
 
-				POINT point_ie = point2, point_is = ConvertCoordFromPositionToPixel(position2);
 
-				long leg_x = point_is.x - point_ie.x, leg_y = point_is.y - point_ie.y;
-				double mul = HOLD_RADIUS / hold->length;
-				long rad_x = (double) leg_y * mul, rad_y = (double) -leg_x * mul;
+bool FlightPlanSource::Parse(
+	std::span<const std::string_view> args,
+	std::string_view,
+	Route &route,
+	std::string &name,
+	std::string &error
+) const {
+	if (args.empty() || args.size() > 2) {
+		error = std::string("expected a callsign");
+		return false;
+	}
 
-				long d = std::round(2.0 * std::sqrt(rad_x * rad_x + rad_y * rad_y)), r = d / 2;
+	std::string callsign = to_upper(args.back());
+	name = args.size() == 2 ? std::string(args[0]) : callsign;
 
-				double ang = std::atan((double) rad_y / (double) rad_x) * DEG_PER_RAD;
-				if (
-					(rad_x <= rad_y && rad_x <= -rad_y) ||
-					(rad_x < rad_y && rad_x > -rad_y && ang < 0) ||
-					(rad_x > rad_y && rad_x < -rad_y && ang > 0)
-				) ang += 180;
+	EuroScope::CFlightPlan flight_plan = plugin->FlightPlanSelect(callsign.c_str());
+	if (!flight_plan.IsValid()) {
+		error = std::string("no flight plan for ") + callsign;
+		return false;
+	}
 
-				if (hold->left_turns) {
-					rad_x *= -1; rad_y *= -1;
-				}
+	// EuroScope has already resolved the route against its own navigation data
+	EuroScope::CFlightPlanExtractedRoute extracted = flight_plan.GetExtractedRoute();
+	int count = extracted.GetPointsNumber();
+	route.reserve(count);
 
-				POINT point_oc = point_ie, point_ic = point_is;
+	for (int i = 0; i < count; i++) {
+		EuroScope::CPosition position = extracted.GetPointPosition(i);
 
-				point_oc.x += rad_x; point_oc.y += rad_y;
-				point_ic.x += rad_x; point_ic.y += rad_y;
+		Node node(position.m_Latitude, position.m_Longitude);
+		node.label = strings.intern(std::string_view(extracted.GetPointName(i)));
+		route.push_back(node);
+	}
 
-				POINT point_os = point_oc, point_oe = point_ic;
+	return true;
+}
 
-				point_os.x += rad_x; point_os.y += rad_y;
-				point_oe.x += rad_x; point_oe.y += rad_y;
 
-				pen.SetColor(colour((double) i / (double) n));
 
-				ctx->DrawArc(&pen, point_oc.x - r, point_oc.y - r, d, d, ang, -180);
-				ctx->DrawLine(&pen, point_os.x, point_os.y, point_oe.x, point_oe.y);
-				ctx->DrawArc(&pen, point_ic.x - r, point_ic.y - r, d, d, ang, 180);
-				ctx->DrawLine(&pen, point_is.x, point_is.y, point_ie.x, point_ie.y);
-			}
+Library::~Library() {
+	if (view) UnmapViewOfFile(view);
+	if (mapping) CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+}
 
-			if (i < 1 || route[i - 1].IsDiscontinuity()) continue;
+// "RPL1"; u32 routes; { u16 length; char name[length]; u32 offset, size; }[routes]
+// each offset is from the start of the file to a route in the binary format
+bool Library::open(const std::string &path, std::string &error) {
+	file = CreateFileA(
+		path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr
+	);
+	if (file == INVALID_HANDLE_VALUE) {
+		error = std::string("could not open file");
+		return false;
+	}
 
-			auto line_brush = LinearGradientBrush(
-				Point(point1.x, point1.y), Point(point2.x, point2.y),
-				colour((double) (i - 1) / (double) n), colour((double) i / (double) n)
-			);
-			brush_pen.SetBrush(&line_brush);
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart < 8 || file_size.QuadPart > UINT32_MAX) {
+		error = std::string("not a route library");
+		return false;
+	}
 
-			ctx->DrawLine(&brush_pen, point1.x, point1.y, point2.x, point2.y);
+	mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping) view = (const uint8_t *) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!view) {
+		error = std::string("could not map file");
+		return false;
+	}
 
-			if (!clip.Contains(point2.x, point2.y)) continue;
+	size_t size = (size_t) file_size.QuadPart;
+	BinaryReader reader = { view + 4, view + size };
+	uint32_t count;
 
-			double length = std::hypot(point2.x - point1.x, point2.y - point1.y);
-			for (double target = inter; target < dist + length; target += inter) {
-				double t = (target - dist) / length;
-				labels.push_back({
-					std::wstring(name.begin(), name.end()),
-					(1.0 - t) * point1.x + t * point2.x,
-					(1.0 - t) * point1.y + t * point2.y,
-					std::atan((double) (point1.y - point2.y) / (double) (point2.x - point1.x))
-				});
-			}
-			dist = std::fmod(dist + length, inter);
-		}
+	if (std::memcmp(view, "RPL1", 4) || !reader.read(count)) {
+		error = std::string("not a route library");
+		return false;
 	}
 
-	SolidBrush brush(Color(0xdd, 0xdd, 0xdd));
+	for (uint32_t i = 0; i < count; i++) {
+		uint16_t length;
+		uint32_t offset, route_size;
 
-	for (const auto &label : labels) {
-		ctx->TranslateTransform(label.x, label.y);
-		ctx->RotateTransform(-label.angle * DEG_PER_RAD);
-		ctx->TranslateTransform(-label.x, -label.y);
+		if (!reader.read(length) || (size_t) (reader.end - reader.data) < length) goto truncated;
+		std::string_view name((const char *) reader.data, length);
+		reader.data += length;
 
-		PointF centre(label.x, label.y);
-		ctx->DrawString(label.content.c_str(), -1, &font, centre, &brush);
+		if (!reader.read(offset) || !reader.read(route_size)) goto truncated;
+		if (offset > size || route_size > size - offset) goto truncated;
 
-		ctx->ResetTransform();
+		entries.insert_or_assign(std::string(name), std::span(view + offset, route_size));
 	}
 
-	brush.SetColor(Color(0xff, 0xff, 0xff));
-	pen.SetColor(Color(0xff, 0xff, 0xff));
+	return true;
 
-	std::vector<RectF> label_rects;
-	RectF label_rect;
+truncated:
+	error = std::string("truncated route library");
+	return false;
+}
 
-	for (const auto &[_, route] : plugin->routes) {
-		size_t n = route.size() - 1;
-		for (size_t i = 0; i <= n; i++) {
-			if (route[i].IsDiscontinuity()) continue;
+bool Library::load(std::string_view name, Route &route, std::string &error) const {
+	auto it = entries.find(name);
+	if (it == entries.cend()) {
+		error = std::string("no such route in the library");
+		return false;
+	}
 
-			position1.m_Latitude = route[i].lat;
-			position1.m_Longitude = route[i].lon;
+	return decode_binary(it->second, route, error);
+}
 
-			point1 = ConvertCoordFromPositionToPixel(position1);
+// each plot is saved as "<NAME> <GROUP> <NAVDATA> <DATA> [COMMAND]", where
+// DATA is the route in the binary format, and NAVDATA the version of the
+// navigation data it was resolved against; either is "-" if not applicable,
+// and live plots are saved as their command alone
+void Plugin::save_plots(Screen &screen) {
+	size_t count = 0;
+	auto save = [&](
+		const std::string &name, std::string_view navdata, std::string_view data, std::string_view command
+	) {
+		screen.SaveDataToAsr(
+			std::format("Plot{}", count++).c_str(), "",
+			escape_asr(std::format("{} {} {} {} {}", name, group_of(name), navdata, data, command)).c_str()
+		);
+	};
 
-			int r = route[i].highlight ? 4 : 1;
-			ctx->DrawEllipse(&pen, point1.x - r, point1.y - r, r * 2, r * 2);
+	for (const auto &[name, plot] : routes) {
+		if (auto live = live_plots.find(name); live != live_plots.end()) {
+			save(name, "-", "-", live->second.command);
+			continue;
+		}
 
-			if (route[i].label.size() > 0) {
-				PointF origin(point1.x + r + 4, point1.y - (FONT_SIZE / 2));
+		std::string data = encode_base64(encode_binary(plot->route));
 
-				ctx->MeasureString(route[i].label.c_str(), -1, &font, origin, &label_rect);
-				if (std::none_of(
-					label_rects.cbegin(), label_rects.cend(),
-					[label_rect](auto &rect2) { return rect2.IntersectsWith(label_rect); }
-				)) {
-					ctx->DrawString(route[i].label.c_str(), -1, &font, origin, &brush);
-					label_rects.push_back(label_rect);
-				}
-			}
-		}
+		if (auto resolved = resolved_plots.find(name); resolved != resolved_plots.end())
+			save(name, std::format("{:016x}", resolved->second.navdata), data, resolved->second.command);
+		else
+			save(name, "-", data, "");
 	}
-}
-
 
+	// plots following flight plans which aren't yet known
+	for (const auto &[name, live] : live_plots)
+		if (routes.find(name) == routes.end()) save(name, "-", "-", live.command);
 
-Plugin::Plugin(void) :
-	EuroScope::CPlugIn(
-		EuroScope::COMPATIBILITY_CODE,
-		PLUGIN_NAME, PLUGIN_VERSION, PLUGIN_AUTHORS, PLUGIN_LICENCE
-	)
-{
-	sources["coords"] = std::make_unique<CoordsSource>();
-	sources["route"] = std::make_unique<RouteSource>();
+	screen.SaveDataToAsr("Plots", "Number of plotted routes", std::to_string(count).c_str());
 }
 
-bool Plugin::OnCompileCommand(const char *command) {
-	std::istringstream buf(command);
-	std::vector<std::string> parts(std::istream_iterator<std::string>(buf), {});
+void Plugin::restore_plots(Screen &screen) {
+	const char *count = screen.GetDataFromAsr("Plots");
+	if (!count) return;
 
-	if (parts.empty() || parts[0] != COMMAND_PREFIX) return false;
+	size_t failed = 0;
 
-	if (parts.size() == 1 || parts[1] == "help") {
-		size_t width = 15; // strlen("clear [NAME]...")
-		for (const auto &[name, source] : sources) {
-			size_t unique_size = name.size() + std::strlen(source->HelpArguments());
-			width = std::max(width, unique_size + 8 /* strlen(" [NAME] ") */);
-		}
+	for (size_t k = 0, n = std::strtoul(count, nullptr, 10); k < n; k++) {
+		const char *data = screen.GetDataFromAsr(std::format("Plot{}", k).c_str());
+		if (!data || !restore_plot(unescape_asr(data))) failed++;
+	}
 
-		display_message("", "Available commands:");
-		display_command("help", "Display this help text", width);
-		display_command("clear [NAME]...", "Remove the named plot, or all plots", width);
+	resolve_restored();
 
-		for (const auto &[name, source] : sources) {
-			display_command(
-				std::format("{} [NAME] {}", name, source->HelpArguments()).c_str(),
-				source->HelpDescription(),
-				width
-			);
-		}
+	routes_version++;
+	flush();
 
-		display_command("[NAME] <ROUTE>", "Shortcut for \".plot route [NAME] <ROUTE>\"", width);
-		display_message("", "See <" PLUGIN_WEBSITE "> for more information.");
+	if (failed)
+		display_message("Error", std::format("{} saved plots could not be restored", failed).c_str(), true);
+}
 
-		return true;
-	}
+bool Plugin::restore_plot(std::string_view data) {
+	std::vector<std::string_view> fields = tokenize(data);
+	if (fields.size() < 4) return false;
 
-	if (parts[1] == "clear") {
-		if (parts.size() > 2) {
-			for (auto it = parts.cbegin() + 2; it < parts.cend(); it++) {
-				routes.erase(*it);
-			}
-		} else {
-			routes.clear();
-		}
+	std::string name(fields[0]);
+	std::string_view command;
+	if (fields.size() > 4) command = data.substr(fields[4].data() - data.data());
 
-		for (auto screen : screens)
-			if (screen) screen->RefreshMapContent();
+	// later plots are not given the names of restored ones
+	int number;
+	auto [end, ec] = std::from_chars(name.data(), name.data() + name.size(), number);
+	if (ec == std::errc() && end == name.data() + name.size()) name_counter = std::max(name_counter, number);
 
-		return true;
-	}
+	auto restore_group = [&]() {
+		if (fields[1] != DEFAULT_GROUP) plot_groups[name] = fields[1];
+		else plot_groups.erase(name);
+	};
 
-	auto source = sources.find(parts[1]);
-	int offset = 2;
+	// live plots are parsed again, and otherwise wait for their flight plan
+	if (fields[3] == "-") {
+		PlotCommand plot = split_plot(command);
+		if (!plot.source->Live() || plot.args.empty()) return false;
 
-	if (source == sources.cend()) {
-		source = sources.find("route");
-		offset = 1;
+		std::string plot_name = name, error;
+		Route route;
+
+		if (parse_plot(plot, plot_name, route, error) && route.size() > 0)
+			store_plot(name, Plot(name, std::move(route)));
+		live_plots[name] = { to_upper(plot.args.back()), std::string(command) };
+		restore_group();
+
+		return true;
 	}
 
-	std::string name = std::to_string(++name_counter), error;
+	std::vector<uint8_t> bytes;
 	Route route;
+	std::string error;
 
-	std::string_view sv(command);
-	size_t ofs = 0;
-	for (int i = 0; i < offset; i++)
-		ofs = sv.find_first_not_of(' ', sv.find_first_of(' ', ofs));
+	if (!decode_base64(fields[3], bytes) || !decode_binary(bytes, route, error) || route.empty())
+		return false;
 
-	if (source->second->Parse(
-		parts.begin() + offset, parts.end(),
-		command + ofs,
-		route, name, error
-	)) {
-		if (route.size() > 0) {
-			routes[name] = route;
+	store_plot(name, Plot(name, std::move(route)));
+	restore_group();
 
-			for (auto screen : screens)
-				if (screen) screen->RefreshMapContent();
-		}
+	uint64_t navdata;
+	auto version = std::from_chars(fields[2].data(), fields[2].data() + fields[2].size(), navdata, 16);
 
-		return true;
-	} else {
-		display_message("Error", error.c_str(), true);
-		return false;
+	if (version.ec == std::errc() && !command.empty()) {
+		resolved_plots[name] = { std::string(command), navdata };
+		restored_plots.insert(name);
 	}
+
+	return true;
 }
 
-Screen *Plugin::OnRadarScreenCreated(const char *, bool, bool, bool geo, bool) {
-	if (!geo) return nullptr;
+void Plugin::resolve_restored() {
+	const Navdata *data = navdata();
+	if (!data || restored_plots.empty()) return;
 
-	auto *screen = new Screen(screens.size());
-	screens.push_back(screen);
+	// storing a plot forgets that it was restored
+	auto names = std::move(restored_plots);
+	restored_plots.clear();
 
-	return screen;
-}
+	for (const auto &name : names) {
+		auto resolved = resolved_plots.find(name);
+		if (resolved == resolved_plots.end() || resolved->second.navdata == data->version) continue;
 
-void Plugin::display_message(const char *from, const char *msg, bool urgent) {
-	DisplayUserMessage(PLUGIN_NAME, from, msg, true, true, urgent, urgent, false);
-}
+		// the plot is left as saved if it can no longer be resolved
+		std::string command = resolved->second.command, plot_name = name, error;
+		PlotCommand plot = split_plot(command);
+		Route route;
 
-void Plugin::display_command(const char *command, const char *help, size_t width) {
-	display_message(
-		"",
-		std::format("  " COMMAND_PREFIX " {:<{}} - {}", command, width, help).c_str()
-	);
+		if (!parse_plot(plot, plot_name, route, error) || route.size() == 0) continue;
+
+		store_plot(name, Plot(name, std::move(route)));
+		resolved_plots[name] = { std::move(command), data->version };
+		routes_version++;
+	}
 }
 
 
 
-static signed char decode(char c) {
-	if ('A' <= c && c <= 'Z') return c - 'A';
-	if ('a' <= c && c <= 'z') return 26 + c - 'a';
-	if ('0' <= c && c <= '9') return 52 + c - '0';
-	return -1;
-}
+Navdata::Navdata(const std::vector<SectorElement> &elements) {
+	// FNV-1a, over each field and its length
+	version = 0xcbf29ce484222325;
+	auto hash = [this](const void *data, size_t size) {
+		for (size_t i = 0; i < size; i++)
+			version = (version ^ ((const uint8_t *) data)[i]) * 0x100000001b3;
+	};
+	auto hash_field = [&hash](const void *data, size_t size) {
+		uint32_t length = size;
+		hash(&length, sizeof(length));
+		hash(data, size);
+	};
 
-bool CoordsSource::Parse(
-	std::vector<std::string>::iterator args_it,
-	std::vector<std::string>::iterator args_end,
-	const char *command,
-	Route &route,
-	std::string &name,
-	std::string &error
-) const {
-	if (args_it >= args_end || !*command) {
-		error = std::string("missing string");
-		return false;
+	for (const auto &el : elements) {
+		hash(&el.type, sizeof(el.type));
+		hash_field(el.name.data(), el.name.size());
+		hash_field(el.airport.data(), el.airport.size());
+		hash_field(el.runways[0].data(), el.runways[0].size());
+		hash_field(el.runways[1].data(), el.runways[1].size());
+		hash_field(el.positions.data(), el.positions.size() * sizeof(Position));
 	}
 
-	if (args_end - args_it > 1 && args_it->find('(') == std::string::npos) {
-		name = *args_it;
+	for (const auto &el : elements) {
+		switch (el.type) {
+			case EuroScope::SECTOR_ELEMENT_AIRPORT:
+				if (!el.positions.empty())
+					airports.insert_or_assign(el.name, el.positions.front());
 
-		command += args_it->size();
-		command += std::strspn(command, " ");
-	}
+			case EuroScope::SECTOR_ELEMENT_VOR:
+			case EuroScope::SECTOR_ELEMENT_NDB:
+			case EuroScope::SECTOR_ELEMENT_FIX:
+				if (!el.positions.empty())
+					points.insert_or_assign(el.name, el.positions.front());
 
-	Node item;
-	signed char word[7];
+				break;
 
-	if (command[0] != '@') command--;
+			case EuroScope::SECTOR_ELEMENT_RUNWAY: {
+				std::string_view airport(el.airport);
+				airport = airport.substr(0, 4);
 
-	while (*(++command)) {
-		if (*command == '(' && route.size()) {
-			int count = 1;
-			const char *start = command + 1, *end;
+				for (int j = 0; j <= 1; j++)
+					if (!std::isnan(el.positions[j].lat))
+						runways.insert_or_assign(
+							std::format("{}/{}", airport, el.runways[j]),
+							el.positions[j]
+						);
 
-			while (*(++command)) {
-				end = strpbrk(command, "()");
-				if (!end) {
-					error = std::string("missing closing bracket");
-					return false;
-				}
-				if (*end == '(') count++;
-				else count--;
-				command = end;
-				if (!count) break;
+				break;
 			}
 
-			std::wstring sc(end - start + 1, L'\0');
-			for (const char *c = start; c < end; c++) sc[c - start] = *c;
-			route.back().label = std::wstring(sc);
+			// this will break if an aerodrome has an identically-named SID & STAR lol
+			case EuroScope::SECTOR_ELEMENT_SIDS_STARS:
+				// the first matching procedure is used
+				procedures.try_emplace(
+					std::format("{}/{}/{}", el.airport, el.runways[0], el.name),
+					Path { el.positions }
+				);
+				procedures.try_emplace(
+					std::format("{}//{}", el.airport, el.name),
+					Path { el.positions }
+				);
 
-			continue;
-		} else if (*command == '-') {
-			item.lat = NAN;
-			item.highlight = false;
-		} else if ((word[0] = decode(*command)) >= 0) {
-			for (int i = 1; i < 7; i++)
-				if ((word[i] = decode(*(++command))) < 0) {
-					error = std::string("invalid character");
-					return false;
-				}
+				break;
 
-			item.lat = word[1] + ((double) word[2] + (double) word[3] / 60) / 60;
-			item.lon = word[4] + ((double) word[5] + (double) word[6] / 60) / 60;
+			case EuroScope::SECTOR_ELEMENT_LOW_AIRWAY:
+			case EuroScope::SECTOR_ELEMENT_HIGH_AIRWAY: {
+				auto &vec = airways[el.name].positions;
+				for (const auto &npos : el.positions)
+					if (vec.empty() || npos != vec.back()) vec.push_back(npos);
 
-			item.lat += 60.0 * ((word[0] >> 2) & 0b01);
-			item.lon += 60.0 * ((word[0] >> 4) & 0b11);
+				break;
+			}
+		}
+	}
 
-			if (word[0] & 0b0010) item.lat = -item.lat;
-			if (word[0] & 0b1000) item.lon = -item.lon;
+	for (auto &[_, airway] : airways) airway.build_index();
+	for (auto &[_, procedure] : procedures) procedure.build_index();
+}
 
-			item.highlight = false;
-			item.hold = std::nullopt;
+void Path::build_index() {
+	indices.clear();
+	indices.reserve(positions.size());
 
-			if (word[0] & 1) {
-				signed char extra1 = decode(*(++command));
-				if (extra1 < 0) {
-					error = std::string("invalid character");
-					return false;
-				}
+	for (size_t i = 0; i < positions.size(); i++) indices.try_emplace(positions[i], i);
+}
 
-				if (extra1 >= 60) {
-					item.highlight = true;
-				} else {
-					signed char extra2 = decode(*(++command));
-					if (extra2 < 0) {
-						error = std::string("invalid character");
-						return false;
-					}
+std::optional<size_t> Path::find(const Position &pos) const {
+	auto it = indices.find(pos);
+	if (it == indices.end()) return std::nullopt;
+	return it->second;
+}
 
-					item.hold = Hold(
-						(double) (extra2 & 0b1111),
-						6.0 * (double) extra1 + ((extra2 >> 5) ? 3.0 : 0.0),
-						((extra2 >> 4) & 1) == 1
-					);
-				}
-			}
-		} else {
-			error = std::string("invalid structural character");
-			return false;
-		}
+const Position *Navdata::find_point(std::string_view name) const {
+	auto it = points.find(name);
+	return it == points.end() ? nullptr : &it->second;
+}
 
-		item.label.clear();
-		route.push_back(item);
+const Position *Navdata::find_airport(std::string_view airport, std::string_view runway) const {
+	if (runway.data()) {
+		auto it = runways.find(std::format("{}/{}", airport.substr(0, 4), runway));
+		return it == runways.end() ? nullptr : &it->second;
+	} else {
+		auto it = airports.find(airport);
+		return it == airports.end() ? nullptr : &it->second;
 	}
+}
 
-	return true;
+const Path *Navdata::find_airway(std::string_view name) const {
+	auto it = airways.find(name);
+	return it == airways.end() ? nullptr : &it->second;
+}
+
+const Path *Navdata::find_procedure(
+	std::string_view airport, std::string_view runway, std::string_view name
+) const {
+	auto it = procedures.find(std::format("{}/{}/{}", airport, runway, name));
+	return it == procedures.end() ? nullptr : &it->second;
 }
 
 
 
 bool RouteSource::Parse(
-	std::vector<std::string>::iterator start,
-	std::vector<std::string>::iterator end,
-	const char *,
+	std::span<const std::string_view> args,
+	std::string_view,
 	Route &route,
 	std::string &name,
 	std::string &error
 ) const {
+	auto start = args.begin(), end = args.end();
+
 	struct Point {
 		std::string_view name, runway;
 		struct {
@@ -585,19 +4060,12 @@ bool RouteSource::Parse(
 		} hold;
 	};
 
-	struct Position {
-		double lat, lon;
-
-		inline bool operator==(const Position &) const = default;
-	};
-
 	if ((end - start) % 2 == 0) name = *(start++);
 
 	std::vector<Point> points;
 	std::vector<std::string_view> ats_routes;
 
 	std::unordered_map<std::string_view, Position> point_positions;
-	std::unordered_map<std::string_view, std::vector<Position>> ats_route_positions;
 
 	auto it = start;
 	for (bool p = true; it != end; p ^= 1, it++) {
@@ -623,7 +4091,7 @@ bool RouteSource::Parse(
 							return false;
 						}
 
-						int len = it->size() > sep ? std::stoi(std::string(*it, sep)) : 4;
+						int len = it->size() > sep ? std::stoi(std::string(it->substr(sep))) : 4;
 
 						point.hold.crs = crs;
 						point.hold.len = len;
@@ -631,6 +4099,9 @@ bool RouteSource::Parse(
 					} catch (const std::invalid_argument &_) {
 						error = std::string("invalid integer");
 						return false;
+					} catch (const std::out_of_range &_) {
+						error = std::string("integer out of range");
+						return false;
 					}
 				} else if (it == start || end - it == 1) {
 					point.runway = std::string_view(it->data() + sep, it->size() - sep);
@@ -643,13 +4114,18 @@ bool RouteSource::Parse(
 			Position position = { 0.0, 0.0 };
 
 			if ('0' <= point.name[0] && point.name[0] <= '9') {
-				const char *src = point.name.data();
+				// the name is a view into the command, so must not be read past its end
+				const char *src = point.name.data(), *src_end = src + point.name.size();
 				char *lat_sign, *lon_sign;
 
 				auto int_lat = std::strtoul(src, &lat_sign, 10);
-				if (!*lat_sign || (*lat_sign != 'N' && *lat_sign != 'S')) goto ll_fail;
+				// strtoul would otherwise skip the space before the next token
+				if (
+					lat_sign + 1 >= src_end || (*lat_sign != 'N' && *lat_sign != 'S') ||
+					!std::isdigit((unsigned char) lat_sign[1])
+				) goto ll_fail;
 				auto int_lon = std::strtoul(lat_sign + 1, &lon_sign, 10);
-				if (!*lon_sign || (*lon_sign != 'E' && *lon_sign != 'W')) goto ll_fail;
+				if (lon_sign >= src_end || (*lon_sign != 'E' && *lon_sign != 'W')) goto ll_fail;
 
 				for (int i = (lat_sign - src) / 2; i > 1; i--) {
 					position.lat += (double) (int_lat % 100);
@@ -679,101 +4155,47 @@ bool RouteSource::Parse(
 		} else if (*it == "DCT") {
 			ats_routes.push_back({});
 		} else {
-			ats_route_positions.emplace(*it, std::vector<Position>());
 			ats_routes.push_back(*it);
 		}
 	}
 
-	std::vector<Position> sid, star;
-	Position adep, ades;
-
-	EuroScope::CPosition pos;
-
-	for (
-		auto el = plugin->SectorFileElementSelectFirst(EuroScope::SECTOR_ELEMENT_ALL);
-		el.IsValid();
-		el = plugin->SectorFileElementSelectNext(el, EuroScope::SECTOR_ELEMENT_ALL)
-	) {
-		switch (el.GetElementType()) {
-			case EuroScope::SECTOR_ELEMENT_AIRPORT:
-				for (int i = 0; i <= 1; i++) {
-					const Point &point = i ? points.front() : points.back();
-					Position &adp = i ? adep : ades;
-
-					if (point.runway.empty() && !point.name.compare(el.GetName()))
-						if (el.GetPosition(&pos, 0))
-							adp = { pos.m_Latitude, pos.m_Longitude };
-				}
-
-			case EuroScope::SECTOR_ELEMENT_VOR:
-			case EuroScope::SECTOR_ELEMENT_NDB:
-			case EuroScope::SECTOR_ELEMENT_FIX: {
-				auto it = point_positions.find(el.GetName());
-				if (it != point_positions.end())
-					if (el.GetPosition(&pos, 0))
-						std::get<1>(*it) = { pos.m_Latitude, pos.m_Longitude };
-
-				break;
-			}
+	const Navdata *navdata = plugin->navdata();
+	if (!navdata) {
+		error = std::string("navigation data not loaded");
+		return false;
+	}
 
-			case EuroScope::SECTOR_ELEMENT_RUNWAY:
-				for (int i = 0; i <= 1; i++) {
-					const Point &point = i ? points.front() : points.back();
-					Position &adp = i ? adep : ades;
+	for (auto &[point_name, position] : point_positions)
+		if (std::isnan(position.lat))
+			if (const Position *found = navdata->find_point(point_name))
+				position = *found;
 
-					if (point.runway.data() && !point.name.compare(0, 4, el.GetAirportName(), 4))
-						for (int j = 0; j <= 1; j++)
-							if (!point.runway.compare(el.GetRunwayName(j)))
-								if (el.GetPosition(&pos, j))
-									adp = { pos.m_Latitude, pos.m_Longitude };
-				}
+	const Path *sid = nullptr, *star = nullptr;
+	Position adep = { NAN, NAN }, ades = { NAN, NAN };
 
-				break;
+	for (int i = 0; i <= 1; i++) {
+		const Point &point = i ? points.front() : points.back();
+		Position &adp = i ? adep : ades;
 
-			// this will break if an aerodrome has an identically-named SID & STAR lol
-			case EuroScope::SECTOR_ELEMENT_SIDS_STARS:
-				if (ats_routes.empty()) break;
-
-				for (int i = 0; i <= 1; i++) {
-					const Point &point = i ? points.front() : points.back();
-					const std::string_view &ats = i ? ats_routes.front() : ats_routes.back();
-					std::vector<Position> &out = i ? sid : star;
-
-					if (
-						out.empty() &&
-						!point.name.compare(el.GetAirportName()) &&
-						(point.runway.empty() || !point.runway.compare(el.GetRunwayName(0))) &&
-						!ats.compare(el.GetName())
-					)
-						for (int j = 0; el.GetPosition(&pos, j); j++)
-							out.push_back({ pos.m_Latitude, pos.m_Longitude });
-				}
+		if (const Position *found = navdata->find_airport(point.name, point.runway))
+			adp = *found;
 
-				break;
+		if (ats_routes.empty()) continue;
 
-			case EuroScope::SECTOR_ELEMENT_LOW_AIRWAY:
-			case EuroScope::SECTOR_ELEMENT_HIGH_AIRWAY: {
-				auto it = ats_route_positions.find(el.GetName());
-				if (it != ats_route_positions.end())
-					for (int i = 0; el.GetPosition(&pos, i); i++) {
-						auto &vec = std::get<1>(*it);
-						Position npos = { pos.m_Latitude, pos.m_Longitude };
-						if (vec.empty() || npos != vec.back()) vec.push_back(npos);
-					}
+		const std::string_view &ats = i ? ats_routes.front() : ats_routes.back();
+		const Path *&out = i ? sid : star;
 
-				break;
-			}
-		}
+		if (ats.data())
+			if (auto *found = navdata->find_procedure(point.name, point.runway, ats))
+				if (!found->positions.empty()) out = found;
 	}
 
-	if (!star.empty()) star.push_back(ades);
-
 	Position seg_end, seg_start;
 
 	for (int i = 0; i < points.size(); i++) {
-		if (i == 0 && !sid.empty()) {
+		if (i == 0 && sid) {
 			seg_end = adep;
-		} else if (i == points.size() - 1 && !star.empty()) {
+		} else if (i == points.size() - 1 && star) {
 			seg_end = ades;
 		} else {
 			auto it = point_positions.find(points[i].name);
@@ -786,26 +4208,30 @@ bool RouteSource::Parse(
 		}
 
 		if (i > 0 && ats_routes[i - 1].data()) {
-			const std::vector<Position> *ats;
-
-			if (i == 1 && !sid.empty()) {
-				ats = &sid;
-			} else if (i == points.size() - 1 && !star.empty()) {
-				ats = &star;
+			const Path *ats;
+			bool is_sid = false, is_star = false;
+
+			if (i == 1 && sid) {
+				ats = sid;
+				is_sid = true;
+			} else if (i == points.size() - 1 && star) {
+				ats = star;
+				is_star = true;
 			} else {
-				auto it = ats_route_positions.find(ats_routes[i - 1]);
-				if (it == ats_route_positions.end()) {
+				ats = navdata->find_airway(ats_routes[i - 1]);
+				if (!ats) {
 					error = std::format("could not find airway '{}'", ats_routes[i - 1]);
 					return false;
-				} else {
-					ats = &std::get<1>(*it);
 				}
 			}
 
-			auto from = ats->cbegin(), to = ats->cend();
+			const auto &positions = ats->positions;
+			size_t from = 0, to = positions.size();
 
-			if (ats != &sid) {
-				if ((from = std::find(ats->cbegin(), ats->cend(), seg_start)) == ats->cend()) {
+			if (!is_sid) {
+				if (auto found = ats->find(seg_start)) {
+					from = *found;
+				} else {
 					error = std::format(
 						"discontinuity ({} to {})",
 						points[i - 1].name,
@@ -816,8 +4242,10 @@ bool RouteSource::Parse(
 				}
 			}
 
-			if (ats != &star) {
-				if ((to = std::find(ats->cbegin(), ats->cend(), seg_end)) == ats->cend()) {
+			if (!is_star) {
+				if (auto found = ats->find(seg_end)) {
+					to = *found;
+				} else {
 					error = std::format(
 						"discontinuity ({} to {})",
 						ats_routes[i - 1],
@@ -828,18 +4256,26 @@ bool RouteSource::Parse(
 				}
 			}
 
-			if (from < to)
-				for (auto it = (ats == &sid || ats == &star) ? from : ++from; it < to; it++)
-					route.push_back({ it->lat, it->lon });
-			else
-				for (auto it = --from; it > to; it--)
-					route.push_back({ it->lat, it->lon });
+			// procedures are followed from their first point or entry fix
+			// inclusive, and STARs on to the aerodrome
+			if (is_sid || is_star) {
+				for (size_t j = from; j < to; j++)
+					route.push_back({ positions[j].lat, positions[j].lon });
+				if (is_star) route.push_back({ ades.lat, ades.lon });
+			} else if (from < to) {
+				for (size_t j = from + 1; j < to; j++)
+					route.push_back({ positions[j].lat, positions[j].lon });
+			} else {
+				for (size_t j = from; j-- > to + 1;)
+					route.push_back({ positions[j].lat, positions[j].lon });
+			}
 		}
 
 		Node point(seg_end.lat, seg_end.lon);
 
 		if (points[i].hold.len) {
 			point.hold = Hold(
+				seg_end.lat, seg_end.lon,
 				points[i].hold.len,
 				points[i].hold.crs,
 				points[i].hold.lh
@@ -849,10 +4285,7 @@ bool RouteSource::Parse(
 		}
 
 		if (points[i].name[0] < '0' || points[i].name[0] > '9') {
-			std::wstring label;
-			for (int j = 0; j < points[i].name.size(); j++)
-				label.push_back((std::wstring::value_type) points[i].name[j]);
-			point.label = label;
+			point.label = strings.intern(points[i].name);
 		}
 
 		route.push_back(point);